@@ -21,7 +21,20 @@
 #include <PRM/PRM_Include.h>
 #include <GU/GU_Detail.h>
 #include <GA/GA_Attribute.h>
+#include <GA/GA_AttributeFilter.h>
+#include <GA/GA_EdgeGroup.h>
+#include <GA/GA_ElementGroup.h>
+#include <GA/GA_ATINumeric.h>
+#include <GEO/GEO_PrimPoly.h>
+#include <GEO/GEO_PolyCounts.h>
+#include <UT/UT_ParallelUtil.h>
+#include <GA/GA_PageHandle.h>
+#include <GA/GA_SplittableRange.h>
+#include <UT/UT_BoundingBox.h>
+#include <UT/UT_UniquePtr.h>
+#include <UT/UT_WorkBuffer.h>
 #include <SYS/SYS_Math.h>
+#include <algorithm>
 #include <iostream>
 #include "sop_gpattern.h"
 
@@ -40,12 +53,17 @@ static PRM_Name use_uvs_prm("use_uv_attr", "Use UV Attribute");
 static PRM_Name num_tiles_prm("tiles", "Num Tiles");
 static PRM_Name scale_compensate_prm("scale", "Scale Compensate");
 static PRM_Range scalerange_prm(PRM_RANGE_UI, -1, PRM_RANGE_UI, 2);
+static PRM_Name surface_tolerance_prm("surface_tolerance", "Surface Tolerance");
+static PRM_Default surface_tolerance_default(0.001);
+static PRM_Range surface_tolerance_range(PRM_RANGE_RESTRICTED, 0, PRM_RANGE_UI, 0.1);
 
 PRM_Template
 SOP_Gpattern::parmsTemplatesList[] = {
         PRM_Template(PRM_TOGGLE_E, 1, &use_uvs_prm, PRMzeroDefaults),
         PRM_Template(PRM_UVW, 2, &num_tiles_prm, PRMoneDefaults),
         PRM_Template(PRM_FLT_E, 1, &scale_compensate_prm, PRMoneDefaults, 0, &scalerange_prm),
+        PRM_Template(PRM_FLT_E, 1, &surface_tolerance_prm, &surface_tolerance_default, 0,
+                     &surface_tolerance_range),
         PRM_Template(),
 };
 
@@ -54,6 +72,7 @@ SOP_Gpattern::updateParmsFlags()
 {
     bool changes = false;
     changes |= enableParm(num_tiles_prm.getToken(), !PRMUseUVs());
+    changes |= enableParm(surface_tolerance_prm.getToken(), !PRMUseUVs());
     return changes;
 }
 
@@ -66,103 +85,733 @@ void SOP_Gpattern::pointRelativeToBbox(const UT_Vector3 &pt, UT_Vector2 &uv)
     uv[1] = SYSfit(pt[1], bbox_min[1], bbox_max[1], 0, 1);
 }
 
-void computeTemplateMaxUV(const GU_Detail *template_geo, float &max_u, float &max_v)
+void computeTemplateMaxUV(const UVTriangleTree &uv_tree, float &max_u, float &max_v)
 {
-    auto uv_hdl = GA_ROHandleV3(template_geo->findTextureAttribute(GA_ATTRIB_POINT));
-    GA_Offset ptoff;
-    max_u, max_v = 0;
-    GA_FOR_ALL_PTOFF(template_geo, ptoff)
+    max_u = max_v = 0;
+    if (uv_tree.nodes.entries())
+    {
+        max_u = SYSmax(max_u, uv_tree.nodes(0).max[0]);
+        max_v = SYSmax(max_v, uv_tree.nodes(0).max[1]);
+    }
+}
+// Bounding box of the pattern points
+class ComputePatternBounds
+{
+public:
+    ComputePatternBounds(const GA_Attribute *attr_p)
+        : attr_p(attr_p)
+    {
+        bbox.initBounds();
+    }
+
+    ComputePatternBounds(const ComputePatternBounds &src, UT_Split)
+        : attr_p(src.attr_p)
+    {
+        bbox.initBounds();
+    }
+
+    void operator()(const GA_SplittableRange &r)
+    {
+        GA_ROPageHandleV3 ph(attr_p);
+        GA_Offset start, end;
+        for (GA_Iterator it(r); it.blockAdvance(start, end);)
+        {
+            ph.setPage(start);
+            for (GA_Offset ptoff = start; ptoff < end; ++ptoff)
+                bbox.enlargeBounds(ph.get(ptoff));
+        }
+    }
+
+    void join(const ComputePatternBounds &other)
+    {
+        bbox.enlargeBounds(other.bbox);
+    }
+
+    UT_BoundingBox bbox;
+
+private:
+    const GA_Attribute *attr_p;
+};
+
+// Pattern coordinates in point index order, the tiles read these instead
+// of attributes on a copy of the pattern
+void SOP_Gpattern::computePatternCoords(const GU_Detail *pattern_geo)
+{
+    // Index order, as the tile topology numbers its points, which isn't
+    // the offset order once the points were sorted
+    const GA_Size npts = pattern_geo->getNumPoints();
+    parms.pattern_points.setSize(npts);
+    for (GA_Size i = 0; i < npts; ++i)
+        parms.pattern_points(i) = pattern_geo->pointOffset(GA_Index(i));
+
+    ComputePatternBounds bounds(pattern_geo->getP());
+    UTparallelReduce(GA_SplittableRange(pattern_geo->getPointRange()), bounds);
+    bbox_min = bounds.bbox.minvec();
+    bbox_max = bounds.bbox.maxvec();
+
+    parms.pattern_uv.setSize(npts);
+    parms.pattern_dist.setSize(npts);
+    UTparallelFor(UT_BlockedRange<GA_Size>(0, npts), [&](const UT_BlockedRange<GA_Size> &r)
+    {
+        GA_ROHandleV3 ph(pattern_geo->getP());
+        for (GA_Size i = r.begin(); i < r.end(); ++i)
         {
-            UT_Vector3 uv = uv_hdl.get(ptoff);
-            if (uv[0] > max_u) max_u = uv[0];
-            if (uv[1] > max_v) max_v = uv[1];
+            const UT_Vector3 ppos = ph.get(parms.pattern_points(i));
+            pointRelativeToBbox(ppos, parms.pattern_uv(i));
+            parms.pattern_dist(i) = SYSabs(ppos[2]);
         }
+    });
+}
+
+// The template is never evaluated at s or t of 1
+static const float max_st = 0.99999f;
+static const int max_grid_res = 1025;
+
+// Particles, packed primitives, open curves and other primitives without an
+// interior can't carry tiles
+static bool
+hasInterior(const GEO_Primitive *prim)
+{
+    UT_Vector4 pos;
+    return prim->evaluateInteriorPoint(pos, 0.5f, 0.5f);
+}
 
+static inline void
+catmullRomWeights(float x, float w[4])
+{
+    const float x2 = x * x;
+    const float x3 = x2 * x;
+    w[0] = 0.5f * (-x3 + 2.0f * x2 - x);
+    w[1] = 0.5f * (3.0f * x3 - 5.0f * x2 + 2.0f);
+    w[2] = 0.5f * (-3.0f * x3 + 4.0f * x2 + x);
+    w[3] = 0.5f * (x3 - x2);
 }
-void SOP_Gpattern::computePatternGeoAttibs()
+
+void
+SurfaceGrid::evaluate(const GEO_Primitive *prim, int res_s, int res_t)
 {
+    this->res_s = res_s;
+    this->res_t = res_t;
+    P.setSize(res_s * res_t);
+    N.setSize(res_s * res_t);
+    UTparallelFor(UT_BlockedRange<int>(0, res_t), [&](const UT_BlockedRange<int> &r)
+    {
+        for (int j = r.begin(); j < r.end(); ++j)
+        {
+            const float t = max_st * j / (res_t - 1);
+            for (int i = 0; i < res_s; ++i)
+            {
+                const float s = max_st * i / (res_s - 1);
+                UT_Vector4 pos(0, 0, 0, 1);
+                UT_Vector3 nml(0, 0, 0);
+                if (prim->evaluateInteriorPoint(pos, s, t))
+                {
+                    prim->evaluateNormalVector(nml, s, t);
+                    nml.normalize();
+                }
+                P(j * res_s + i).assign(pos.x(), pos.y(), pos.z());
+                N(j * res_s + i) = nml;
+            }
+        }
+    });
+}
+
+// Doubles the grid until the samples that a refinement adds are within
+// tolerance of the coarser grid lookup, and keeps the finer one. The
+// tolerance is relative to the primitive size for positions, and bounds
+// 1 - dot of the normals so large gently curved templates still refine.
+// Primitives without an interior get no grid.
+bool
+SurfaceGrid::build(const GEO_Primitive *prim, float tolerance)
+{
+    if (!hasInterior(prim))
+    {
+        res_s = res_t = 0;
+        P.entries(0);
+        N.entries(0);
+        return false;
+    }
     UT_BoundingBox bbox;
-    pattern_geo->getBBox(&bbox);
-    bbox_min = bbox.minvec();
-    bbox_max = bbox.maxvec();
-    GA_Offset ptoff;
-    GA_ROHandleV3 ph = GA_ROHandleV3(pattern_geo->getP());
-    auto bbox_uv_hdl = GA_RWHandleV2(pattern_geo->addFloatTuple(GA_ATTRIB_POINT, "bboxuv", 2));
-    auto point_dist_hdl = GA_RWHandleR(pattern_geo->addFloatTuple(GA_ATTRIB_POINT, "point_dist", 1));
-    UT_Vector2 bbox_uv;
-    GA_FOR_ALL_PTOFF(pattern_geo, ptoff)
+    prim->getBBox(&bbox);
+    const float abs_tolerance = SYSmax(tolerance * bbox.sizeMax(), 1e-6f);
+    const float tolerance2 = abs_tolerance * abs_tolerance;
+    int res = 9;
+    evaluate(prim, res, res);
+    while (res < max_grid_res)
+    {
+        SurfaceGrid fine;
+        fine.evaluate(prim, 2 * res - 1, 2 * res - 1);
+        bool within = true;
+        for (int j = 0; j < fine.res_t && within; ++j)
+        {
+            for (int i = (j & 1) ? 0 : 1; i < fine.res_s && within; i += (j & 1) ? 1 : 2)
+            {
+                UT_Vector3 pos, nml;
+                lookup(max_st * i / (fine.res_s - 1), max_st * j / (fine.res_t - 1), pos, nml);
+                const int idx = j * fine.res_s + i;
+                if ((pos - fine.P(idx)).length2() > tolerance2)
+                    within = false;
+                // Degenerate normals, at poles or collapsed edges, are skipped
+                else if (fine.N(idx).length2() > 0.5f && 1.0f - dot(nml, fine.N(idx)) > tolerance)
+                    within = false;
+            }
+        }
+        res = fine.res_s;
+        P.swap(fine.P);
+        N.swap(fine.N);
+        res_s = fine.res_s;
+        res_t = fine.res_t;
+        if (within)
+            break;
+    }
+    return true;
+}
+
+void
+SurfaceGrid::lookup(float s, float t, UT_Vector3 &pos, UT_Vector3 &nml) const
+{
+    const float fs = SYSclamp(s / max_st, 0.0f, 1.0f) * (res_s - 1);
+    const float ft = SYSclamp(t / max_st, 0.0f, 1.0f) * (res_t - 1);
+    const int is = SYSmin(int(fs), res_s - 2);
+    const int it = SYSmin(int(ft), res_t - 2);
+    float ws[4], wt[4];
+    catmullRomWeights(fs - is, ws);
+    catmullRomWeights(ft - it, wt);
+    pos.assign(0, 0, 0);
+    nml.assign(0, 0, 0);
+    for (int j = 0; j < 4; ++j)
+    {
+        const int row = SYSclamp(it + j - 1, 0, res_t - 1) * res_s;
+        for (int i = 0; i < 4; ++i)
+        {
+            const int idx = row + SYSclamp(is + i - 1, 0, res_s - 1);
+            const float w = ws[i] * wt[j];
+            pos += P(idx) * w;
+            nml += N(idx) * w;
+        }
+    }
+    nml.normalize();
+}
+
+static const int uv_leaf_size = 4;
+
+bool
+UVTriangleTree::build(const GU_Detail *gdp, const GA_Attribute *uv_attr)
+{
+    uv.entries(0);
+    P.entries(0);
+    N.entries(0);
+    tris.entries(0);
+    nodes.entries(0);
+
+    GA_ROHandleV3 uv_hdl(uv_attr);
+    const bool vertex_uv = uv_attr->getOwner() == GA_ATTRIB_VERTEX;
+    GA_ROHandleV3 n_hdl(gdp->findNormalAttribute(GA_ATTRIB_POINT));
+
+    // Area weighted point normals when the template has none
+    UT_Array<UT_Vector3> point_n;
+    if (!n_hdl.isValid())
+    {
+        point_n.setSize(gdp->getNumPointOffsets());
+        point_n.constant(UT_Vector3(0, 0, 0));
+    }
+
+    UT_Array<GA_Offset> corner_points;
+    for (GA_Iterator it(gdp->getPrimitiveRange()); !it.atEnd(); ++it)
+    {
+        const GEO_Primitive *prim = gdp->getGEOPrimitive(*it);
+        const GA_Size nvtx = prim->getVertexCount();
+        if (prim->getTypeId() != GA_PRIMPOLY || nvtx < 3)
+            continue;
+        const UT_Vector3 face_n = prim->computeNormal();
+        for (GA_Size k = 1; k + 1 < nvtx; ++k)
+        {
+            const GA_Size corners[3] = {0, k, k + 1};
+            for (int c = 0; c < 3; ++c)
+            {
+                const GA_Offset ptoff = prim->getPointOffset(corners[c]);
+                const UT_Vector3 tex = uv_hdl.get(vertex_uv ? prim->getVertexOffset(corners[c]) : ptoff);
+                uv.append(UT_Vector2(tex[0], tex[1]));
+                P.append(gdp->getPos3(ptoff));
+                corner_points.append(ptoff);
+            }
+            if (point_n.entries())
+            {
+                const exint first = P.entries() - 3;
+                const float area = cross(P(first + 1) - P(first), P(first + 2) - P(first)).length();
+                for (int c = 0; c < 3; ++c)
+                    point_n(corner_points(first + c)) += face_n * area;
+            }
+        }
+    }
+    N.setSize(corner_points.entries());
+    for (exint i = 0; i < corner_points.entries(); ++i)
+    {
+        N(i) = n_hdl.isValid() ? n_hdl.get(corner_points(i)) : point_n(corner_points(i));
+        N(i).normalize();
+    }
+
+    const int num_tris = int(uv.entries() / 3);
+    if (!num_tris)
+        return false;
+    UT_Array<UT_Vector2> centers;
+    centers.setSize(num_tris);
+    tris.setSize(num_tris);
+    for (int i = 0; i < num_tris; ++i)
+    {
+        centers(i) = (uv(3 * i) + uv(3 * i + 1) + uv(3 * i + 2)) / 3.0f;
+        tris(i) = i;
+    }
+    nodes.setCapacity(2 * (num_tris / uv_leaf_size + 1));
+    buildNode(0, num_tris, centers);
+    return true;
+}
+
+// Median split along the longer side of the UV bounds
+int
+UVTriangleTree::buildNode(int start, int end, const UT_Array<UT_Vector2> &centers)
+{
+    const int index = int(nodes.entries());
+    nodes.append();
+    UT_Vector2 lo(SYS_FP32_MAX, SYS_FP32_MAX), hi(-SYS_FP32_MAX, -SYS_FP32_MAX);
+    for (int i = start; i < end; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            const UT_Vector2 &corner = uv(3 * tris(i) + c);
+            lo[0] = SYSmin(lo[0], corner[0]);
+            lo[1] = SYSmin(lo[1], corner[1]);
+            hi[0] = SYSmax(hi[0], corner[0]);
+            hi[1] = SYSmax(hi[1], corner[1]);
+        }
+    }
+    nodes(index).min = lo;
+    nodes(index).max = hi;
+    if (end - start <= uv_leaf_size)
+    {
+        nodes(index).start = start;
+        nodes(index).count = end - start;
+        return index;
+    }
+
+    const int axis = (hi[0] - lo[0] >= hi[1] - lo[1]) ? 0 : 1;
+    const int mid = (start + end) / 2;
+    std::nth_element(tris.array() + start, tris.array() + mid, tris.array() + end,
+                     [&](int a, int b) { return centers(a)[axis] < centers(b)[axis]; });
+    buildNode(start, mid, centers);
+    const int right = buildNode(mid, end, centers);
+    nodes(index).start = right;
+    nodes(index).count = 0;
+    return index;
+}
+
+// Squared UV distance to the triangle, 0 inside, with the barycentric
+// weights of the closest point.
+static float
+closestBarycentric(const UT_Vector2 *corners, const UT_Vector2 &pt, float w[3])
+{
+    const UT_Vector2 e0 = corners[1] - corners[0];
+    const UT_Vector2 e1 = corners[2] - corners[0];
+    const UT_Vector2 p = pt - corners[0];
+    const float det = e0[0] * e1[1] - e0[1] * e1[0];
+    if (SYSabs(det) > 1e-12f)
+    {
+        const float b1 = (p[0] * e1[1] - p[1] * e1[0]) / det;
+        const float b2 = (e0[0] * p[1] - e0[1] * p[0]) / det;
+        if (b1 >= 0 && b2 >= 0 && b1 + b2 <= 1)
+        {
+            w[0] = 1 - b1 - b2;
+            w[1] = b1;
+            w[2] = b2;
+            return 0;
+        }
+    }
+
+    // Outside, or degenerate in UV, the closest point is on an edge
+    float best = SYS_FP32_MAX;
+    for (int e = 0; e < 3; ++e)
     {
-        const UT_Vector3 ppos = ph.get(ptoff);
-        pointRelativeToBbox(ppos, bbox_uv);
-        bbox_uv_hdl.set(ptoff, bbox_uv);
+        const UT_Vector2 &a = corners[e];
+        const UT_Vector2 ab = corners[(e + 1) % 3] - a;
+        const UT_Vector2 ap = pt - a;
+        const float len2 = ab[0] * ab[0] + ab[1] * ab[1];
+        const float f = len2 > 0 ? SYSclamp((ap[0] * ab[0] + ap[1] * ab[1]) / len2, 0.0f, 1.0f) : 0.0f;
+        const UT_Vector2 d = ap - ab * f;
+        const float dist2 = d[0] * d[0] + d[1] * d[1];
+        if (dist2 < best)
+        {
+            best = dist2;
+            w[e] = 1 - f;
+            w[(e + 1) % 3] = f;
+            w[(e + 2) % 3] = 0;
+        }
+    }
+    return best;
+}
+
+// Pattern points outside every UV shell snap to the closest triangle
+void
+UVTriangleTree::lookup(float u, float v, UT_Vector3 &pos, UT_Vector3 &nml) const
+{
+    const UT_Vector2 pt(u, v);
+    float best_dist2 = SYS_FP32_MAX;
+    float best_w[3] = {1, 0, 0};
+    int best_tri = -1;
 
-        UT_Vector3 pos_on_plane = ppos;
-        pos_on_plane[2] = 0;
-        fpreal dist = (ppos - pos_on_plane).length();
-        point_dist_hdl.set(ptoff, dist);
+    int stack[64];
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth && best_dist2 > 0)
+    {
+        const Node &node = nodes(stack[--depth]);
+        const float dx = SYSmax(node.min[0] - u, 0.0f, u - node.max[0]);
+        const float dy = SYSmax(node.min[1] - v, 0.0f, v - node.max[1]);
+        if (dx * dx + dy * dy >= best_dist2 && best_tri >= 0)
+            continue;
+        if (node.count)
+        {
+            for (int i = node.start; i < node.start + node.count; ++i)
+            {
+                float w[3];
+                const float dist2 = closestBarycentric(&uv(3 * tris(i)), pt, w);
+                if (dist2 < best_dist2 || best_tri < 0)
+                {
+                    best_dist2 = dist2;
+                    best_tri = tris(i);
+                    std::copy(w, w + 3, best_w);
+                }
+            }
+            continue;
+        }
 
+        // Nearer child popped first
+        const int left = int(&node - nodes.array()) + 1;
+        const int right = node.start;
+        const Node &l = nodes(left);
+        const Node &r = nodes(right);
+        const float cl = SYSmax(l.min[0] - u, 0.0f, u - l.max[0]) + SYSmax(l.min[1] - v, 0.0f, v - l.max[1]);
+        const float cr = SYSmax(r.min[0] - u, 0.0f, u - r.max[0]) + SYSmax(r.min[1] - v, 0.0f, v - r.max[1]);
+        stack[depth++] = cl <= cr ? right : left;
+        stack[depth++] = cl <= cr ? left : right;
     }
 
+    pos.assign(0, 0, 0);
+    nml.assign(0, 0, 0);
+    if (best_tri < 0)
+        return;
+    for (int c = 0; c < 3; ++c)
+    {
+        pos += P(3 * best_tri + c) * best_w[c];
+        nml += N(3 * best_tri + c) * best_w[c];
+    }
+    nml.normalize();
 }
 
-void movePatternToTile(GU_Detail *pattern_copy,
-                        const GEO_Primitive *template_prim,
-                        const int tile,
-                        const float max_u,
-                        const float max_v,
-                        const float scale)
+void movePatternToTile(const ThreadParms &parms,
+                       const int tile,
+                       GA_RWHandleV3 &ph)
 {
+    const TemplatePatch &patch = parms.patches(parms.tile_patch(tile));
+    const GEO_Primitive *template_prim = patch.prim;
+    const float max_u = patch.max_u;
+    const float max_v = patch.max_v;
+    const int patch_tile = tile - patch.first_tile;
     int u_tiles = SYSceil(max_u);
     float du = 0;
     float dv = 0;
     float ru, rv;
     fpreal32 s, t;
 
-    if (tile == 0)
-        du, dv = 0;
-    else if (tile > 0 && tile < u_tiles)
-        du += tile;
-    else
+    if (patch_tile > 0 && patch_tile < u_tiles)
+        du += patch_tile;
+    else if (patch_tile > 0)
     {
-        du += tile % u_tiles;
-        dv += SYSfloor(static_cast<fpreal>(tile/u_tiles));
+        du += patch_tile % u_tiles;
+        dv += SYSfloor(static_cast<fpreal>(patch_tile/u_tiles));
     }
-    GA_ROHandleV2 bboxuv_hdl(pattern_copy->findFloatTuple(GA_ATTRIB_POINT, "bboxuv"));
-    GA_RWHandleV3 ph = GA_RWHandleV3(pattern_copy->getP());
-    GA_RWHandleR point_dist_hdl = GA_RWHandleR(pattern_copy->findFloatTuple(GA_ATTRIB_POINT, "point_dist"));
-    for (GA_Iterator it(pattern_copy->getPointRange()); !it.atEnd(); it.advance())
+    const GA_Size npts = parms.pattern_points.entries();
+    const GA_Offset tile_start = parms.tiles_start + GA_Size(tile) * npts;
+    const GA_Offset *tile_points = parms.tile_points.entries()
+                                   ? parms.tile_points.array() + GA_Size(tile) * npts : nullptr;
+    for (GA_Size i = 0; i < npts; ++i)
     {
-        UT_Vector4 primP;
+        const GA_Offset ptoff = tile_points ? tile_points[i] : tile_start + i;
+        UT_Vector3 primP;
         UT_Vector3 primN;
-        UT_Vector2 bboxuv = bboxuv_hdl.get(*it);
+        const UT_Vector2 &bboxuv = parms.pattern_uv(i);
         ru = bboxuv[0] + du;
         rv = bboxuv[1] + dv;
 
+        if (patch.uv_tree)
+        {
+            patch.uv_tree->lookup(ru, rv, primP, primN);
+            primP = primP + primN * parms.pattern_dist(i) * parms.scale;
+            ph.set(ptoff, primP);
+            continue;
+        }
         s = SYSfit(ru, (fpreal32)0.0, max_u, (fpreal32)0.0, (fpreal32)0.99999);
         t = SYSfit(rv, (fpreal32)0.0, max_v, (fpreal32)0.0, (fpreal32)0.99999);
-        template_prim->evaluateInteriorPoint(primP, s, t);
-        template_prim->evaluateNormalVector(primN, s, t);
-        primN.normalize();
-        primP = primP + primN * point_dist_hdl.get(*it) * scale;
-        ph.set(*it, primP);
+        if (patch.surface)
+            patch.surface->lookup(s, t, primP, primN);
+        else
+        {
+            // Only primitives with an interior have tiles
+            UT_Vector4 pos(0, 0, 0, 1);
+            primN.assign(0, 0, 0);
+            if (template_prim->evaluateInteriorPoint(pos, s, t))
+            {
+                template_prim->evaluateNormalVector(primN, s, t);
+                primN.normalize();
+            }
+            primP.assign(pos.x(), pos.y(), pos.z());
+        }
+        primP = primP + primN * parms.pattern_dist(i) * parms.scale;
+        ph.set(ptoff, primP);
+    }
+
+}
+
+// Copy the pattern values of one attribute class to every tile, tile i of
+// the output owns the elements after dst_start + i * src_offsets.entries().
+// Numeric pages are hardened first so tiles write them from any thread,
+// strings and other shared data are copied serially.
+static void
+copyTileAttributes(GU_Detail *gdp, const GU_Detail *pattern_geo, GA_AttributeOwner owner,
+                   const UT_Array<GA_Offset> &src_offsets, GA_Offset dst_start, int numtiles)
+{
+    const GA_Size n = src_offsets.entries();
+    gdp->cloneMissingAttributes(*pattern_geo, owner, GA_AttributeFilter::selectPublic());
+    for (GA_AttributeDict::iterator it = pattern_geo->getAttributeDict(owner).begin(GA_SCOPE_PUBLIC);
+         !it.atEnd(); ++it)
+    {
+        const GA_Attribute *src = it.attrib();
+        GA_Attribute *dst = gdp->findAttribute(owner, src->getName());
+        if (!dst || src == pattern_geo->getP())
+            continue;
+        auto copy_tiles = [&](const UT_BlockedRange<int> &r)
+        {
+            for (int tile = r.begin(); tile < r.end(); ++tile)
+            {
+                const GA_Offset tile_start = dst_start + GA_Size(tile) * n;
+                for (GA_Size i = 0; i < n; ++i)
+                    dst->copy(tile_start + i, *src, src_offsets(i));
+            }
+        };
+        if (GA_ATINumeric::isType(dst))
+        {
+            dst->hardenAllPages();
+            UTparallelFor(UT_BlockedRange<int>(0, numtiles), copy_tiles);
+        }
+        else
+            copy_tiles(UT_BlockedRange<int>(0, numtiles));
     }
+}
 
+// Members of a pattern group added to the same group on every tile, the
+// elements of tile i start at dst_start + i * src_offsets.entries().
+static void
+copyTileGroup(const GA_ElementGroup *src, GA_ElementGroup *dst, const UT_Array<GA_Offset> &src_offsets,
+              GA_Offset dst_start, int numtiles)
+{
+    const GA_Size n = src_offsets.entries();
+    UT_Array<GA_Size> members;
+    for (GA_Size i = 0; i < n; ++i)
+        if (src->contains(src_offsets(i)))
+            members.append(i);
+    if (!members.entries())
+        return;
+    for (int tile = 0; tile < numtiles; ++tile)
+    {
+        const GA_Offset tile_start = dst_start + GA_Size(tile) * n;
+        for (exint i = 0; i < members.entries(); ++i)
+            dst->addOffset(tile_start + members(i));
+    }
 }
 
+// Point, primitive, vertex and edge groups of the pattern on every tile.
+// Primitives and vertices are skipped for point only patterns.
+static void
+copyTileGroups(GU_Detail *gdp, const GU_Detail *pattern_geo, const ThreadParms &parms,
+               const UT_Array<GA_Offset> &pattern_prims, GA_Offset prims_start,
+               const UT_Array<GA_Offset> &pattern_vertices, GA_Offset vertices_start)
+{
+    const int numtiles = parms.numtiles;
+    for (GA_ElementGroupTable::iterator it = pattern_geo->pointGroups().beginTraverse(); !it.atEnd(); ++it)
+    {
+        const GA_ElementGroup *src = it.group();
+        if (!src->isInternal())
+            copyTileGroup(src, gdp->newPointGroup(src->getName()), parms.pattern_points,
+                          parms.tiles_start, numtiles);
+    }
+    if (!pattern_prims.entries())
+        return;
+    for (GA_ElementGroupTable::iterator it = pattern_geo->primitiveGroups().beginTraverse(); !it.atEnd(); ++it)
+    {
+        const GA_ElementGroup *src = it.group();
+        if (!src->isInternal())
+            copyTileGroup(src, gdp->newPrimitiveGroup(src->getName()), pattern_prims, prims_start, numtiles);
+    }
+    for (GA_ElementGroupTable::iterator it = pattern_geo->vertexGroups().beginTraverse(); !it.atEnd(); ++it)
+    {
+        const GA_ElementGroup *src = it.group();
+        if (!src->isInternal())
+            copyTileGroup(src, gdp->newVertexGroup(src->getName()), pattern_vertices, vertices_start, numtiles);
+    }
+
+    // Edges are point pairs, and optionally their primitive
+    if (!pattern_geo->edgeGroups().entries())
+        return;
+    UT_Array<GA_Size> prim_position;
+    prim_position.setSize(pattern_geo->getNumPrimitiveOffsets());
+    prim_position.constant(-1);
+    for (exint i = 0; i < pattern_prims.entries(); ++i)
+        prim_position(pattern_prims(i)) = i;
+    const GA_Size npts = parms.pattern_points.entries();
+    const GA_Size nprims = pattern_prims.entries();
+    for (GA_EdgeGroupTable::iterator it = pattern_geo->edgeGroups().beginTraverse(); !it.atEnd(); ++it)
+    {
+        const GA_EdgeGroup *src = it.group();
+        if (src->isInternal())
+            continue;
+        GA_EdgeGroup *dst = gdp->newEdgeGroup(src->getName());
+        for (GA_EdgeGroup::const_iterator eit = src->begin(); !eit.atEnd(); ++eit)
+        {
+            const GA_Edge &edge = eit.getEdge();
+            const GA_Offset primoff = eit.getPrimitive();
+            const GA_Index p0 = pattern_geo->pointIndex(edge.p0());
+            const GA_Index p1 = pattern_geo->pointIndex(edge.p1());
+            const GA_Size prim = GAisValid(primoff) ? prim_position(primoff) : -1;
+            for (int tile = 0; tile < numtiles; ++tile)
+            {
+                const GA_Edge tile_edge(parms.tiles_start + tile * npts + p0,
+                                        parms.tiles_start + tile * npts + p1);
+                dst->add(tile_edge, prim >= 0 ? prims_start + tile * nprims + prim : GA_INVALID_OFFSET);
+            }
+        }
+    }
+}
+
+// Points and primitives of all the tiles are allocated at once, so the
+// tiles only write P into their own points afterwards. Point clouds
+// append a single point block and polygon patterns build every tile in
+// a single polygon block. Other primitive types are merged, the tiles
+// merged so far doubling with every merge, and their points are found
+// through the output index order, whatever holes or order the pattern
+// offsets have.
 void
-SOP_Gpattern::cookTilesPartial(ThreadParms *parms, const UT_JobInfo &info) {
-    int i,n;
-    GU_Detail *copy;
-    for (info.divideWork(parms->numtiles, i, n); i < n; i++)
+SOP_Gpattern::allocateTiles(ThreadParms &parms)
+{
+    const GU_Detail *pattern_geo = parms.pattern_geo;
+    const int numtiles = parms.numtiles;
+    parms.tile_points.entries(0);
+
+    const GA_Size npts = parms.pattern_points.entries();
+    UT_Array<GA_Offset> detail_offsets;
+    detail_offsets.append(GA_DETAIL_OFFSET);
+
+    UT_Array<GA_Offset> pattern_prims, pattern_vertices;
+    UT_Array<GA_Size> polygon_sizes;
+    UT_Array<int> polygon_points;
+    UT_Array<GA_Size> open_prims;         // built closed, opened afterwards
+    bool polygons = true;
+    for (GA_Iterator it(pattern_geo->getPrimitiveRange()); !it.atEnd(); ++it)
     {
-        copy = new GU_Detail(parms->pattern_geo);
-        movePatternToTile(copy, parms->template_prim, i, parms->max_u, parms->max_v, parms->scale);
-        info.lock();
-        gdp->merge(*copy);
-        info.unlock();
+        const GA_Primitive *prim = pattern_geo->getPrimitive(*it);
+        if (prim->getTypeId() != GA_PRIMPOLY)
+        {
+            polygons = false;
+            break;
+        }
+        if (!static_cast<const GEO_PrimPoly *>(prim)->isClosed())
+            open_prims.append(pattern_prims.entries());
+        pattern_prims.append(*it);
+        const GA_Size nvtx = prim->getVertexCount();
+        polygon_sizes.append(nvtx);
+        for (GA_Size i = 0; i < nvtx; ++i)
+        {
+            pattern_vertices.append(prim->getVertexOffset(i));
+            polygon_points.append(int(pattern_geo->pointIndex(prim->getPointOffset(i))));
+        }
+    }
 
+    if (!polygons)
+    {
+        // A merge keeps the index order of the merged points, tile i owns
+        // the output point indices after first + i * npts
+        const GA_Index first = gdp->getNumPoints();
+        UT_UniquePtr<GU_Detail> block(new GU_Detail);
+        block->merge(*pattern_geo);
+        for (int tiles = 1; ; tiles <<= 1)
+        {
+            if (numtiles & tiles)
+                gdp->merge(*block);
+            if (tiles > (numtiles >> 1))
+                break;
+            UT_UniquePtr<GU_Detail> doubled(new GU_Detail);
+            doubled->merge(*block);
+            doubled->merge(*block);
+            block = std::move(doubled);
+        }
+        parms.tiles_start = GA_INVALID_OFFSET;
+        parms.tile_points.setSize(npts * numtiles);
+        UTparallelFor(UT_BlockedRange<GA_Size>(0, npts * numtiles), [&](const UT_BlockedRange<GA_Size> &r)
+        {
+            for (GA_Size i = r.begin(); i < r.end(); ++i)
+                parms.tile_points(i) = gdp->pointOffset(first + GA_Index(i));
+        });
+        return;
     }
-    delete copy;
+
+    parms.tiles_start = gdp->appendPointBlock(npts * numtiles);
+    copyTileAttributes(gdp, pattern_geo, GA_ATTRIB_POINT, parms.pattern_points, parms.tiles_start, numtiles);
+    copyTileAttributes(gdp, pattern_geo, GA_ATTRIB_DETAIL, detail_offsets, GA_DETAIL_OFFSET, 1);
+    if (!pattern_prims.entries())
+    {
+        copyTileGroups(gdp, pattern_geo, parms, pattern_prims, GA_INVALID_OFFSET,
+                       pattern_vertices, GA_INVALID_OFFSET);
+        return;
+    }
+
+    // Tile topology is the pattern one with point numbers shifted by tile
+    const GA_Size nvtx = polygon_points.entries();
+    GEO_PolyCounts tiles_sizes;
+    polygon_points.setSize(nvtx * numtiles);
+    for (int tile = 1; tile < numtiles; ++tile)
+    {
+        int *tile_points = polygon_points.array() + tile * nvtx;
+        for (GA_Size i = 0; i < nvtx; ++i)
+            tile_points[i] = polygon_points(i) + int(tile * npts);
+    }
+    for (int tile = 0; tile < numtiles; ++tile)
+        for (exint i = 0; i < polygon_sizes.entries(); ++i)
+            tiles_sizes.append(polygon_sizes(i));
+
+    const GA_Offset prims_start = GEO_PrimPoly::buildBlock(gdp, parms.tiles_start, npts * numtiles,
+                                                           tiles_sizes, polygon_points.array(), true);
+    const GA_Offset vertices_start = gdp->getPrimitiveVertexOffset(prims_start, 0);
+    const GA_Size nprims = pattern_prims.entries();
+    for (int tile = 0; tile < numtiles && open_prims.entries(); ++tile)
+        for (exint i = 0; i < open_prims.entries(); ++i)
+            static_cast<GEO_PrimPoly *>(gdp->getGEOPrimitive(prims_start + tile * nprims + open_prims(i)))->open();
+
+    copyTileAttributes(gdp, pattern_geo, GA_ATTRIB_PRIMITIVE, pattern_prims, prims_start, numtiles);
+    copyTileAttributes(gdp, pattern_geo, GA_ATTRIB_VERTEX, pattern_vertices, vertices_start, numtiles);
+    copyTileGroups(gdp, pattern_geo, parms, pattern_prims, prims_start, pattern_vertices, vertices_start);
+}
+
+// Every tile writes P into its own disjoint point range, no locks
+void
+SOP_Gpattern::cookTiles(const ThreadParms &parms)
+{
+    GA_Attribute *attr_p = gdp->getP();
+    attr_p->hardenAllPages();
+    UTparallelFor(UT_BlockedRange<int>(0, parms.numtiles), [&](const UT_BlockedRange<int> &r)
+    {
+        GA_RWHandleV3 ph(attr_p);
+        for (int tile = r.begin(); tile < r.end(); ++tile)
+            movePatternToTile(parms, tile, ph);
+    });
+    attr_p->bumpDataId();
 }
 
 OP_ERROR SOP_Gpattern::cookMySop(OP_Context &context) {
@@ -180,44 +829,142 @@ OP_ERROR SOP_Gpattern::cookMySop(OP_Context &context) {
         addError(SOP_ERR_INVALID_SRC, "No primitives in second input");
         return error();
     }
-    const GEO_Primitive *template_prim = template_geo->getGEOPrimitive(template_geo->primitiveOffset(0));
 
-    pattern_geo = new GU_Detail(inputGeo(0, context));
-    // Compute pattern attribs
-    computePatternGeoAttibs();
-    // Compute number of tiles from  template uv attrib
-    float max_u, max_v = 0;
-    if (PRMUseUVs())
+    // UV placement finds the pattern points in a triangle tree of the
+    // whole template, only rebuilt when its geometry or uvs change
+    const bool use_uvs = PRMUseUVs();
+    float max_u = 0, max_v = 0;
+    if (use_uvs)
     {
-		/*auto uv_aref = template_geo->findTextureAttribute(GA_ATTRIB_POINT);
-        if (!uv_aref->isValid())
+        const GA_Attribute *uv_attr = template_geo->findTextureAttribute(GA_ATTRIB_VERTEX);
+        if (!uv_attr)
+            uv_attr = template_geo->findTextureAttribute(GA_ATTRIB_POINT);
+        if (!uv_attr)
         {
-            addError(SOP_ERR_INVALID_SRC, "No uv attribute on points");
+            addError(SOP_ERR_INVALID_SRC, "No uv attribute on template");
             return error();
-        }*/
-        computeTemplateMaxUV(template_geo, max_u, max_v);
+        }
+        UT_Array<fpreal64> key;
+        key.append(template_geo->getUniqueId());
+        key.append(template_geo->getP()->getDataId());
+        key.append(template_geo->getTopology().getDataId());
+        key.append(template_geo->getPrimitiveList().getDataId());
+        key.append(uv_attr->getOwner());
+        key.append(uv_attr->getDataId());
+        const GA_Attribute *n_attr = template_geo->findNormalAttribute(GA_ATTRIB_POINT);
+        key.append(n_attr ? n_attr->getDataId() : -1);
+        if (key != uv_key)
+        {
+            uv_key.clear();
+            if (!uv_tree.build(template_geo, uv_attr))
+            {
+                addError(SOP_ERR_INVALID_SRC, "No polygons in second input");
+                return error();
+            }
+            uv_key = key;
+        }
+        // Compute number of tiles from  template uv attrib
+        computeTemplateMaxUV(uv_tree, max_u, max_v);
     }
-    else
+
+    // Pattern coordinates, only recomputed when the pattern changes
+    const GU_Detail *pattern_geo = inputGeo(0, context);
+    UT_Array<fpreal64> coords_key;
+    coords_key.append(pattern_geo->getUniqueId());
+    coords_key.append(pattern_geo->getP()->getDataId());
+    coords_key.append(pattern_geo->getTopology().getDataId());
+    coords_key.append(pattern_geo->getNumPoints());
+    coords_key.append(pattern_geo->getPointMap().getDataId());
+    if (coords_key != pattern_key)
     {
-        UT_Vector2 tiles;
-        PRMNumTiles(context.getTime(), tiles);
-        max_u = SYSmax(1.0, tiles[0]);
-        max_v = SYSmax(1.0, tiles[1]);
+        computePatternCoords(pattern_geo);
+        pattern_key = coords_key;
     }
+    UT_Vector2 tiles;
+    PRMNumTiles(context.getTime(), tiles);
+    // Per primitive tile counts override the parameter
+    GA_ROHandleV2 tiles_hdl(template_geo->findFloatTuple(GA_ATTRIB_PRIMITIVE, "tiles", 2));
 
-    int num_tiles = SYSmax(1, int(SYSceil(max_u) * SYSceil(max_v)));
+    // Surface samples, only rebuilt when the template or the tolerance change
+    const GA_Size num_patches = use_uvs ? 1 : template_geo->getNumPrimitives();
+    float tolerance = use_uvs ? 0 : PRMSurfaceTolerance(context.getTime());
+    if (tolerance > 0)
+    {
+        UT_Array<fpreal64> key;
+        key.append(template_geo->getUniqueId());
+        key.append(template_geo->getP()->getDataId());
+        key.append(template_geo->getTopology().getDataId());
+        key.append(template_geo->getPrimitiveList().getDataId());
+        key.append(tolerance);
+        if (key != surface_key)
+        {
+            surface_grids.setSize(num_patches);
+            UTparallelFor(UT_BlockedRange<GA_Size>(0, num_patches, 1), [&](const UT_BlockedRange<GA_Size> &r)
+            {
+                for (GA_Size i = r.begin(); i < r.end(); ++i)
+                    surface_grids(i).build(template_geo->getGEOPrimitive(template_geo->primitiveOffset(i)),
+                                           tolerance);
+            });
+            surface_key = key;
+        }
+    }
+
+    // Tiles of all the patches are numbered one after the other, UV
+    // placement tiles the whole template as a single patch. Primitives
+    // without an interior get no tiles.
+    parms.patches.setSize(num_patches);
+    parms.tile_patch.entries(0);
+    int num_tiles = 0;
+    GA_Size num_skipped = 0;
+    for (GA_Size i = 0; i < num_patches; ++i)
+    {
+        const GA_Offset primoff = template_geo->primitiveOffset(i);
+        TemplatePatch &patch = parms.patches(i);
+        patch.prim = use_uvs ? nullptr : template_geo->getGEOPrimitive(primoff);
+        patch.surface = tolerance > 0 ? &surface_grids(i) : nullptr;
+        patch.uv_tree = use_uvs ? &uv_tree : nullptr;
+        if (use_uvs)
+        {
+            patch.max_u = max_u;
+            patch.max_v = max_v;
+        }
+        else
+        {
+            const UT_Vector2 patch_tiles = tiles_hdl.isValid() ? tiles_hdl.get(primoff) : tiles;
+            patch.max_u = SYSmax(1.0f, patch_tiles[0]);
+            patch.max_v = SYSmax(1.0f, patch_tiles[1]);
+        }
+        patch.numtiles = SYSmax(1, int(SYSceil(patch.max_u) * SYSceil(patch.max_v)));
+        if (patch.prim && !hasInterior(patch.prim))
+        {
+            patch.numtiles = 0;
+            ++num_skipped;
+        }
+        patch.first_tile = num_tiles;
+        num_tiles += patch.numtiles;
+        for (int tile = 0; tile < patch.numtiles; ++tile)
+            parms.tile_patch.append(int(i));
+    }
+    if (!num_tiles)
+    {
+        addError(SOP_ERR_INVALID_SRC, "No surface primitives in second input");
+        return error();
+    }
+    if (num_skipped)
+    {
+        UT_WorkBuffer msg;
+        msg.sprintf("%d template primitives without an interior got no tiles", int(num_skipped));
+        addWarning(SOP_MESSAGE, msg.buffer());
+    }
     float scale = PRMScale(context.getTime());
 
     parms.numtiles = num_tiles;
-    parms.max_u = max_u;
-    parms.max_v = max_v;
     parms.scale = scale;
     parms.pattern_geo = pattern_geo;
-    parms.template_prim = template_prim;
 
-    cookTiles(&parms);
+    allocateTiles(parms);
+    cookTiles(parms);
 
-    delete pattern_geo;
     return error();
 
 }
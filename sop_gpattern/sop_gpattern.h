@@ -20,16 +20,76 @@
 #include <OP/OP_Node.h>
 #include <SOP/SOP_Node.h>
 #include <OP/OP_Parameters.h>
-#include <UT/UT_ThreadedAlgorithm.h>
-#include <UT/UT_Thread.h>
+#include <UT/UT_Array.h>
+#include <UT/UT_Vector2.h>
+#include <UT/UT_Vector3.h>
+#include <GEO/GEO_Primitive.h>
 
-struct ThreadParms
+// Position and normal of a template primitive sampled on a regular (s,t)
+// grid, read back with bicubic interpolation instead of evaluating the
+// surface for every pattern point. Read only once built, so all the tile
+// threads share it.
+struct SurfaceGrid
+{
+    int res_s, res_t;
+    UT_Array<UT_Vector3> P, N;
+
+    SurfaceGrid() : res_s(0), res_t(0) {}
+    bool build(const GEO_Primitive *prim, float tolerance);
+    void evaluate(const GEO_Primitive *prim, int res_s, int res_t);
+    void lookup(float s, float t, UT_Vector3 &pos, UT_Vector3 &nml) const;
+};
+
+// Template polygons fan triangulated in UV space under a bounding volume
+// hierarchy. Finds the triangle under a UV position in O(log n) and
+// interpolates P and N across it with the barycentric weights.
+struct UVTriangleTree
 {
+    struct Node
+    {
+        UT_Vector2 min, max;
+        int start;                        // first triangle of a leaf, or the
+                                          // right child, the left one is next
+        int count;                        // triangles of a leaf, 0 if inner
+    };
+
+    UT_Array<UT_Vector2> uv;              // 3 corners per triangle
+    UT_Array<UT_Vector3> P, N;
+    UT_Array<int> tris;                   // triangles in leaf order
+    UT_Array<Node> nodes;
+
+    bool build(const GU_Detail *gdp, const GA_Attribute *uv_attr);
+    void lookup(float u, float v, UT_Vector3 &pos, UT_Vector3 &nml) const;
+
+private:
+    int buildNode(int start, int end, const UT_Array<UT_Vector2> &centers);
+};
+
+// A template primitive and its share of the output tiles
+struct TemplatePatch
+{
+    const GEO_Primitive *prim;
+    const SurfaceGrid *surface;           // null evaluates the primitive directly
+    const UVTriangleTree *uv_tree;        // places the pattern in UV space
+    float max_u, max_v;
     int numtiles;
-    float max_u, max_v, scale;
-    GU_Detail *pattern_geo;
-    const GEO_Primitive *template_prim;
+    int first_tile;                       // of the patch among all the tiles
+};
 
+struct ThreadParms
+{
+    int numtiles;                         // of all the patches
+    float scale;
+    const GU_Detail *pattern_geo;
+    UT_Array<TemplatePatch> patches;
+    UT_Array<int> tile_patch;             // patch of every tile
+    UT_Array<GA_Offset> pattern_points;   // pattern point offsets in index order
+    UT_Array<UT_Vector2> pattern_uv;      // bbox relative xy of every pattern point
+    UT_Array<float> pattern_dist;         // distance of every pattern point to z = 0
+    GA_Offset tiles_start;                // first output point, tile i owns the
+                                          // next npts points after i * npts
+    UT_Array<GA_Offset> tile_points;      // output point of every tile point when
+                                          // the tiles are merged, tile major
 };
 
 class SOP_Gpattern: public SOP_Node
@@ -42,26 +102,25 @@ public:
     static OP_Node *makeOP(OP_Network *net, const char *name, OP_Operator *op);
     OP_ERROR cookMySop(OP_Context &context);
 
-    THREADED_METHOD1(
-            SOP_Gpattern,
-            parms->numtiles > UT_Thread::getNumProcessors(),
-            cookTiles,
-            ThreadParms *, parms);
-
-
-    void cookTilesPartial(ThreadParms *parms, const UT_JobInfo &info);
+    void allocateTiles(ThreadParms &parms);
+    void cookTiles(const ThreadParms &parms);
     virtual bool updateParmsFlags();
 
 private:
     void pointRelativeToBbox(const UT_Vector3 &pt, UT_Vector2 &uv);
-    void computePatternGeoAttibs();
+    void computePatternCoords(const GU_Detail *pattern_geo);
     int PRMUseUVs(){return evalInt("use_uv_attr", 0, 0);}
     void PRMNumTiles(fpreal t, UT_Vector2 &tiles){evalFloats("tiles", tiles.data(), t);}
     float PRMScale(fpreal t){return evalFloat("scale", 0, t);}
+    float PRMSurfaceTolerance(fpreal t){return evalFloat("surface_tolerance", 0, t);}
 
 
     ThreadParms parms;
-    GU_Detail *pattern_geo;
+    UT_Array<SurfaceGrid> surface_grids;  // by template primitive index
+    UT_Array<fpreal64> surface_key;
+    UVTriangleTree uv_tree;
+    UT_Array<fpreal64> uv_key;
+    UT_Array<fpreal64> pattern_key;
     UT_Vector3F bbox_min, bbox_max;
 };
 #endif
@@ -0,0 +1,360 @@
+/*
+ * pathdeform_bench.cpp
+ *
+ *  Points per second of the PathDeform core on synthetic data: a helix
+ *  curve and a box of random points laid along its z axis. Uneven helices
+ *  pack a tenth of their samples in a short stretch, like raw resampled
+ *  paths, and the lookup cases compare against a plain binary search on
+ *  them. Build from this
+ *  directory with
+ *      cmake -S . -B build && cmake --build build
+ *  and run build/pathdeform_bench, --benchmark_filter selects the cases.
+ */
+
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include "pathdeform_core.h"
+
+namespace
+{
+
+// Same contract as the SOP's UTparallelFor adapter, on plain threads.
+struct ThreadFor
+{
+	unsigned int threads;
+
+	template <typename Body>
+	void operator()(unsigned int begin, unsigned int end, unsigned int grain, const Body &body) const
+	{
+		const unsigned int count = end - begin;
+		const unsigned int chunks = std::max(1u, std::min(threads, count / std::max(grain, 1u)));
+		if (chunks == 1)
+		{
+			body(begin, end);
+			return;
+		}
+		std::vector<std::thread> pool;
+		for (unsigned int i = 0; i < chunks; ++i)
+		{
+			const unsigned int b = begin + unsigned(size_t(count) * i / chunks);
+			const unsigned int e = begin + unsigned(size_t(count) * (i + 1) / chunks);
+			pool.emplace_back([&body, b, e]() { body(b, e); });
+		}
+		for (size_t i = 0; i < pool.size(); ++i)
+			pool[i].join();
+	}
+};
+
+enum Spacing
+{
+	SPACING_EVEN = 0,
+	SPACING_UNEVEN       // a tenth of the samples 1000 times closer together
+};
+
+void
+buildHelix(pathdeform::CurveCache &cache, unsigned int npts, int frame_mode, unsigned int threads,
+		int spacing = SPACING_EVEN)
+{
+	std::vector<double> param(npts, 0.0);
+	const unsigned int dense_begin = npts / 3, dense_end = dense_begin + npts / 10;
+	for (unsigned int i = 1; i < npts; ++i)
+	{
+		const bool dense = spacing == SPACING_UNEVEN && i >= dense_begin && i < dense_end;
+		param[i] = param[i - 1] + (dense ? 0.001 : 1.0);
+	}
+
+	cache.resize(&npts, 1);
+	for (unsigned int i = 0; i < npts; ++i)
+	{
+		const float t = float(20.0 * param[i] / param[npts - 1]);
+		cache.P[0][i] = std::cos(t);
+		cache.P[1][i] = std::sin(t);
+		cache.P[2][i] = 0.5f * t;
+		cache.width[i] = 1.0f;
+		cache.twist[i] = 0.0f;
+	}
+	pathdeform::computeArcLength(cache, 0);
+	const float up[3] = {0.0f, 1.0f, 0.0f};
+	ThreadFor pfor = {threads};
+	pathdeform::computeCurveFrames(cache, 0, frame_mode, false, up, pfor);
+}
+
+// Random points in a unit box along z, projected once like the SOP does
+// when only animated parameters change.
+struct PointSet
+{
+	std::vector<float> P, relpos, cu, cb;
+
+	explicit PointSet(size_t count)
+		: P(3 * count), relpos(count), cu(count), cb(count)
+	{
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+		for (size_t i = 0; i < 3 * count; ++i)
+			P[i] = dist(rng);
+
+		pathdeform::ProjectParms parms;
+		parms.axis = 2;
+		parms.center[0] = parms.center[1] = parms.center[2] = 0.0f;
+		parms.axis_min = -0.5f;
+		parms.axis_size = 1.0f;
+		for (size_t i = 0; i < count; i += pathdeform::BLOCK_SIZE)
+		{
+			const int n = int(std::min(count - i, size_t(pathdeform::BLOCK_SIZE)));
+			pathdeform::projectPoints(parms, &P[3 * i], n, &relpos[i], &cu[i], &cb[i]);
+		}
+	}
+};
+
+pathdeform::DeformParms
+deformParms(const pathdeform::CurveCache &cache, int interpolation)
+{
+	pathdeform::DeformParms parms;
+	parms.dist_scale = cache.curveLength(0);
+	parms.dist_bias = 0.0f;
+	parms.roll_cos = std::cos(0.3f);
+	parms.roll_sin = std::sin(0.3f);
+	parms.offset_scale = cache.curveLength(0);
+	parms.stretch_scale = 1.0f;
+	parms.use_width = true;
+	parms.interpolation = interpolation;
+	return parms;
+}
+
+// Every thread takes whole page sized blocks, as GA splittable ranges do.
+void
+deformParallel(const pathdeform::CurveSamples &curve, const pathdeform::DeformParms &parms,
+		pathdeform::KernelISA isa, PointSet &points, unsigned int threads)
+{
+	const size_t count = points.relpos.size();
+	const unsigned int num_blocks = unsigned((count + pathdeform::BLOCK_SIZE - 1) / pathdeform::BLOCK_SIZE);
+	ThreadFor pfor = {threads};
+	pfor(0u, num_blocks, 1u, [&](unsigned int begin, unsigned int end)
+	{
+		std::unique_ptr<pathdeform::DeformBlock> block(new pathdeform::DeformBlock);
+		const size_t first = size_t(begin) * pathdeform::BLOCK_SIZE;
+		const size_t last = std::min(size_t(end) * pathdeform::BLOCK_SIZE, count);
+		pathdeform::deformPoints(curve, parms, isa, &points.relpos[first], &points.cu[first],
+				&points.cb[first], &points.P[3 * first], last - first, *block);
+	});
+}
+
+void
+runDeform(benchmark::State &state, pathdeform::KernelISA isa, int interpolation)
+{
+	const size_t num_points = size_t(state.range(0));
+	const unsigned int curve_points = unsigned(state.range(1));
+	const unsigned int threads = unsigned(state.range(2));
+
+	pathdeform::CurveCache cache;
+	buildHelix(cache, curve_points, pathdeform::FRAME_UP_VECTOR, threads);
+	PointSet points(num_points);
+	const pathdeform::CurveSamples curve = cache.samples(0);
+	const pathdeform::DeformParms parms = deformParms(cache, interpolation);
+	isa = pathdeform::resolveKernelISA(isa);
+
+	for (auto _ : state)
+	{
+		deformParallel(curve, parms, isa, points, threads);
+		benchmark::ClobberMemory();
+	}
+	state.counters["points/s"] = benchmark::Counter(double(num_points) * state.iterations(),
+			benchmark::Counter::kIsRate);
+	state.counters["isa"] = isa;
+}
+
+void
+BM_Deform(benchmark::State &state)
+{
+	runDeform(state, pathdeform::KERNEL_AUTO, pathdeform::INTERP_LINEAR);
+}
+
+void
+BM_DeformCubic(benchmark::State &state)
+{
+	runDeform(state, pathdeform::KERNEL_AUTO, pathdeform::INTERP_CUBIC);
+}
+
+void
+BM_DeformISA(benchmark::State &state)
+{
+	const pathdeform::KernelISA isa = static_cast<pathdeform::KernelISA>(state.range(3));
+	if (pathdeform::resolveKernelISA(isa) != isa)
+	{
+		state.SkipWithError("instruction set not supported by this CPU");
+		return;
+	}
+	runDeform(state, isa, pathdeform::INTERP_LINEAR);
+}
+
+// Random distances along the curve, in page sized blocks.
+std::vector<float>
+randomDistances(const pathdeform::CurveCache &cache, size_t count)
+{
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> dist(0.0f, cache.curveLength(0));
+	std::vector<float> d(count);
+	for (size_t i = 0; i < count; ++i)
+		d[i] = dist(rng);
+	return d;
+}
+
+void
+BM_Lookup(benchmark::State &state)
+{
+	const unsigned int curve_points = unsigned(state.range(0));
+	const int spacing = int(state.range(1));
+	const pathdeform::KernelISA isa = static_cast<pathdeform::KernelISA>(state.range(2));
+	if (pathdeform::resolveKernelISA(isa) != isa)
+	{
+		state.SkipWithError("instruction set not supported by this CPU");
+		return;
+	}
+
+	pathdeform::CurveCache cache;
+	buildHelix(cache, curve_points, pathdeform::FRAME_UP_VECTOR, 1, spacing);
+	const pathdeform::CurveSamples curve = cache.samples(0);
+	const std::vector<float> dist = randomDistances(cache, 1 << 20);
+	std::unique_ptr<pathdeform::DeformBlock> block(new pathdeform::DeformBlock);
+	for (auto _ : state)
+	{
+		for (size_t i = 0; i < dist.size(); i += pathdeform::BLOCK_SIZE)
+		{
+			block->count = pathdeform::BLOCK_SIZE;
+			std::copy(&dist[i], &dist[i] + pathdeform::BLOCK_SIZE, block->dist);
+			pathdeform::lookupBlock(curve, isa, *block);
+			benchmark::DoNotOptimize(block->idx[0]);
+		}
+	}
+	state.counters["lookups/s"] = benchmark::Counter(double(dist.size()) * state.iterations(),
+			benchmark::Counter::kIsRate);
+}
+
+// The same distances through upper_bound over the whole arc length table,
+// the reference for BM_Lookup.
+void
+BM_LookupBinarySearch(benchmark::State &state)
+{
+	const unsigned int curve_points = unsigned(state.range(0));
+	const int spacing = int(state.range(1));
+
+	pathdeform::CurveCache cache;
+	buildHelix(cache, curve_points, pathdeform::FRAME_UP_VECTOR, 1, spacing);
+	const pathdeform::CurveSamples curve = cache.samples(0);
+	const std::vector<float> dist = randomDistances(cache, 1 << 20);
+	std::unique_ptr<pathdeform::DeformBlock> block(new pathdeform::DeformBlock);
+	const float *arclen = curve.arclen;
+	const unsigned int last = curve.num_points - 1;
+	for (auto _ : state)
+	{
+		for (size_t i = 0; i < dist.size(); i += pathdeform::BLOCK_SIZE)
+		{
+			for (int j = 0; j < pathdeform::BLOCK_SIZE; ++j)
+			{
+				const float d = dist[i + j];
+				const int prev = std::min(int(std::upper_bound(arclen, arclen + last + 1, d) - arclen) - 1,
+						int(last) - 1);
+				const float seg_len = arclen[prev + 1] - arclen[prev];
+				block->idx[j] = prev;
+				block->frac[j] = seg_len > 0.0f ? (d - arclen[prev]) / seg_len : 0.0f;
+			}
+			benchmark::DoNotOptimize(block->idx[0]);
+		}
+	}
+	state.counters["lookups/s"] = benchmark::Counter(double(dist.size()) * state.iterations(),
+			benchmark::Counter::kIsRate);
+}
+
+void
+BM_Project(benchmark::State &state)
+{
+	const size_t num_points = size_t(state.range(0));
+	PointSet points(num_points);
+	pathdeform::ProjectParms parms;
+	parms.axis = 2;
+	parms.center[0] = parms.center[1] = parms.center[2] = 0.0f;
+	parms.axis_min = -0.5f;
+	parms.axis_size = 1.0f;
+	for (auto _ : state)
+	{
+		for (size_t i = 0; i < num_points; i += pathdeform::BLOCK_SIZE)
+		{
+			const int n = int(std::min(num_points - i, size_t(pathdeform::BLOCK_SIZE)));
+			pathdeform::projectPoints(parms, &points.P[3 * i], n,
+					&points.relpos[i], &points.cu[i], &points.cb[i]);
+		}
+		benchmark::ClobberMemory();
+	}
+	state.counters["points/s"] = benchmark::Counter(double(num_points) * state.iterations(),
+			benchmark::Counter::kIsRate);
+}
+
+void
+BM_CurveFrames(benchmark::State &state)
+{
+	const unsigned int curve_points = unsigned(state.range(0));
+	const int frame_mode = int(state.range(1));
+	const unsigned int threads = unsigned(state.range(2));
+	pathdeform::CurveCache cache;
+	for (auto _ : state)
+		buildHelix(cache, curve_points, frame_mode, threads);
+	state.counters["samples/s"] = benchmark::Counter(double(curve_points) * state.iterations(),
+			benchmark::Counter::kIsRate);
+}
+
+std::vector<int64_t>
+threadCounts()
+{
+	const int64_t hw = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<int64_t> counts;
+	for (int64_t n = 1; n < hw; n *= 2)
+		counts.push_back(n);
+	counts.push_back(hw);
+	return counts;
+}
+
+} // namespace
+
+BENCHMARK(BM_Deform)
+	->ArgNames({"points", "curve", "threads"})
+	->ArgsProduct({{1000000, 10000000, 50000000}, {16, 1024, 65536}, threadCounts()})
+	->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK(BM_DeformCubic)
+	->ArgNames({"points", "curve", "threads"})
+	->ArgsProduct({{1000000, 10000000}, {16, 1024, 65536}, threadCounts()})
+	->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK(BM_DeformISA)
+	->ArgNames({"points", "curve", "threads", "isa"})
+	->ArgsProduct({{10000000}, {1024}, {1},
+		{pathdeform::KERNEL_SCALAR, pathdeform::KERNEL_SSE41, pathdeform::KERNEL_AVX2}})
+	->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK(BM_Lookup)
+	->ArgNames({"curve", "spacing", "isa"})
+	->ArgsProduct({{1024, 200000, 1048576}, {SPACING_EVEN, SPACING_UNEVEN},
+		{pathdeform::KERNEL_SCALAR, pathdeform::KERNEL_SSE41, pathdeform::KERNEL_AVX2}})
+	->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK(BM_LookupBinarySearch)
+	->ArgNames({"curve", "spacing"})
+	->ArgsProduct({{1024, 200000, 1048576}, {SPACING_EVEN, SPACING_UNEVEN}})
+	->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK(BM_Project)
+	->ArgNames({"points"})
+	->Arg(1000000)->Arg(10000000)->Arg(50000000)
+	->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK(BM_CurveFrames)
+	->ArgNames({"curve", "mode", "threads"})
+	->ArgsProduct({{1024, 65536, 1048576},
+		{pathdeform::FRAME_UP_VECTOR, pathdeform::FRAME_ROTATION_MINIMIZING}, threadCounts()})
+	->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,1401 @@
+/*
+ * pathdeform_core.h
+ *
+ *  Deformation core of PathDeform: curve sample storage, curve frames,
+ *  point projection, arc length parameterization, frame interpolation and
+ *  the curve basis. Header-only and works on plain float arrays, so it has
+ *  no dependency on the Houdini toolkit; the SOP is an adapter that packs
+ *  the curves and feeds it one GA page block (up to 1024 points) at a time,
+ *  and bench/ drives it with synthetic data.
+ *
+ *  Points are first projected on the object axis (projectPoints). The
+ *  result only depends on the input positions and the axis, so the SOP keeps
+ *  it between cooks. Every cook then processes blocks in stages:
+ *   1. load     - bbox relative coordinate to distance along the curve,
+ *                 radial offset rolled around the curve
+ *   2. lookup   - distance to curve segment and fraction, a uniform arc
+ *                 length bucket narrows the binary search to its segments
+ *   3. compose  - lerp curve samples and rebuild the point in the curve frame
+ *   4. store    - write deformed positions back into the page
+ *  Stages 1 and 4 are scalar, stages 2 and 3 run in SSE or AVX2 lanes with
+ *  a scalar tail. The instruction set is picked at runtime. Cubic
+ *  interpolation (Catmull-Rom positions, slerped frame quaternions) has a
+ *  scalar stage 3 only.
+ *
+ *  Loops over curve samples take a ParallelFor callable,
+ *  pfor(begin, end, grain, body) calling body(sub_begin, sub_end) on
+ *  disjoint sub ranges, so every host uses its own thread pool.
+ */
+
+#ifndef PATHDEFORM_CORE_H_
+#define PATHDEFORM_CORE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PATHDEFORM_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+#if defined(PATHDEFORM_X86_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#define PATHDEFORM_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define PATHDEFORM_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define PATHDEFORM_TARGET_SSE41
+#define PATHDEFORM_TARGET_AVX2
+#endif
+
+namespace pathdeform
+{
+
+static const int BLOCK_SIZE = 1024; // GA_PAGE_SIZE
+
+enum KernelISA
+{
+	KERNEL_AUTO = 0,
+	KERNEL_SCALAR,
+	KERNEL_SSE41,
+	KERNEL_AVX2
+};
+
+enum Interpolation
+{
+	INTERP_LINEAR = 0,  // lerp of positions and frame vectors
+	INTERP_CUBIC        // Catmull-Rom positions, slerp of frame quaternions
+};
+
+// Read-only view on the packed curve samples, one array per component.
+struct CurveSamples
+{
+	const float *P[3];
+	const float *T[3];
+	const float *B[3];
+	const float *Up[3];
+	const float *Q[4];     // frame quaternion (w, x, y, z), for cubic interpolation
+	const float *width;
+	const float *arclen;
+	const int *bucket;     // first segment and segment count of every arc length bucket
+	unsigned int num_buckets;
+	float bucket_scale;    // buckets per unit of distance
+	unsigned int num_points;
+	bool closed;           // last sample repeats the first, distances wrap around
+};
+
+// Constants of the projection on the object axis.
+struct ProjectParms
+{
+	int axis;          // object axis laid along the curve, 0 - x, 1 - y, 2 - z
+	float center[3];   // point on the object axis, the radial offset origin
+	float axis_min;    // bbox extent along the axis
+	float axis_size;
+};
+
+// Per-cook constants of the deformation.
+struct DeformParms
+{
+	float dist_scale;  // bbox relative coordinate to distance along the curve
+	float dist_bias;
+	float roll_cos;    // roll around the curve tangent
+	float roll_sin;
+	float offset_scale;  // distance per unit of point offset, the curve length
+	float stretch_scale; // distance per unit of point stretch, the object size
+	bool use_width;
+	int interpolation; // Interpolation
+};
+
+// Optional per-point additions to offset, stretch and roll, indexed like
+// relpos, null when not used. Roll is in turns like the roll parameter.
+struct PointOverrides
+{
+	const float *offset;
+	const float *stretch;
+	const float *roll;
+};
+
+// Stage 0, once per input change. P is an array of xyz triplets as found in
+// a GA page. Writes the bbox relative coordinate along the axis and the
+// radial offset in the curve frame coordinates (up, bitangent).
+inline void
+projectPoints(const ProjectParms &parms, const float *P, int count,
+		float *relpos, float *cu, float *cb)
+{
+	// Radial offset coordinates matching the curve_basis rows of each axis:
+	// x - (T, Up, -B), y - (Up, T, B), z - (B, Up, -T)
+	static const int up_comp[3] = {1, 0, 1};
+	static const int bt_comp[3] = {2, 2, 0};
+	static const float bt_sign[3] = {-1.0f, 1.0f, 1.0f};
+	const int axis = parms.axis;
+	const int iu = up_comp[axis];
+	const int ib = bt_comp[axis];
+	const float cu_origin = parms.center[iu];
+	const float cb_origin = parms.center[ib];
+	const float sign = bt_sign[axis];
+	const float inv_size = parms.axis_size > 0.0f ? 1.0f / parms.axis_size : 0.0f;
+
+	for (int i = 0; i < count; ++i)
+	{
+		const float *pt = P + 3 * i;
+		relpos[i] = (pt[axis] - parms.axis_min) * inv_size;
+		cu[i] = pt[iu] - cu_origin;
+		cb[i] = (pt[ib] - cb_origin) * sign;
+	}
+}
+
+// Per-block scratch, structure-of-arrays.
+struct DeformBlock
+{
+	int count;
+	float dist[BLOCK_SIZE];
+	float cu[BLOCK_SIZE];       // radial offset along the curve up vector
+	float cb[BLOCK_SIZE];       // radial offset along the curve bitangent
+	float roll_cos[BLOCK_SIZE]; // roll of every point
+	float roll_sin[BLOCK_SIZE];
+	int idx[BLOCK_SIZE];        // previous curve sample
+	float frac[BLOCK_SIZE];     // fraction towards the next curve sample
+	float P[3][BLOCK_SIZE];     // deformed positions
+	float T[3][BLOCK_SIZE];     // interpolated curve frame, if requested
+	float B[3][BLOCK_SIZE];
+	float Up[3][BLOCK_SIZE];
+};
+
+// Stage 1. Rolling the frame around the tangent is the same as rotating
+// the radial offset in the (up, bitangent) plane.
+inline void
+loadBlock(const DeformParms &parms, const float *relpos, const float *cu, const float *cb,
+		int count, DeformBlock &block, const PointOverrides *overrides = nullptr)
+{
+	const float c = parms.roll_cos;
+	const float s = parms.roll_sin;
+	block.count = count;
+	for (int i = 0; i < count; ++i)
+	{
+		block.dist[i] = relpos[i] * parms.dist_scale + parms.dist_bias;
+		block.roll_cos[i] = c;
+		block.roll_sin[i] = s;
+	}
+
+	if (overrides)
+	{
+		if (overrides->offset)
+			for (int i = 0; i < count; ++i)
+				block.dist[i] += overrides->offset[i] * parms.offset_scale;
+		if (overrides->stretch)
+			for (int i = 0; i < count; ++i)
+				block.dist[i] += relpos[i] * overrides->stretch[i] * parms.stretch_scale;
+		if (overrides->roll)
+		{
+			// Point roll composed with the roll of the curve
+			const float two_pi = 6.28318530717958647692f;
+			for (int i = 0; i < count; ++i)
+			{
+				const float pc = std::cos(overrides->roll[i] * two_pi);
+				const float ps = std::sin(overrides->roll[i] * two_pi);
+				block.roll_cos[i] = c * pc - s * ps;
+				block.roll_sin[i] = s * pc + c * ps;
+			}
+		}
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		const float rc = block.roll_cos[i];
+		const float rs = block.roll_sin[i];
+		const float u = cu[i];
+		const float b = cb[i];
+		block.cu[i] = rc * u - rs * b;
+		block.cb[i] = rs * u + rc * b;
+	}
+}
+
+// Stage 2, scalar version. Also used for the SIMD tails. The bucket of a
+// distance holds the segments it can fall in, a binary search over them
+// finds the last one starting at or before the distance. Evenly sampled
+// curves have one or two segments per bucket, dense regions cost
+// O(log n) at most. Distances outside the curve clamp to its ends.
+inline void
+lookupScalar(const CurveSamples &curve, int begin, DeformBlock &block)
+{
+	const float *arclen = curve.arclen;
+	const float length = arclen[curve.num_points - 1];
+	const int max_bucket = int(curve.num_buckets) - 1;
+	for (int i = begin; i < block.count; ++i)
+	{
+		const float d = std::min(std::max(block.dist[i], 0.0f), length);
+		const int *range = curve.bucket + 2 * std::min(int(d * curve.bucket_scale), max_bucket);
+		int p = range[0];
+		for (int n = range[1]; n > 1; )
+		{
+			const int half = n >> 1;
+			p = arclen[p + half] <= d ? p + half : p;
+			n -= half;
+		}
+		p = d > 0.0f ? p : 0;  // the first segment, even when it has no length
+		const float seg_len = arclen[p + 1] - arclen[p];
+		block.idx[i] = p;
+		block.frac[i] = seg_len > 0.0f ? (d - arclen[p]) / seg_len : (d < length ? 0.0f : 1.0f);
+	}
+}
+
+// Stage 3, scalar version. Also used for the SIMD tails.
+inline void
+composeScalar(const CurveSamples &curve, const DeformParms &parms, bool want_frames,
+		int begin, DeformBlock &block)
+{
+	for (int i = begin; i < block.count; ++i)
+	{
+		const int p = block.idx[i];
+		const int n = p + 1;
+		const float f = block.frac[i];
+		float w = parms.use_width ? curve.width[p] + f * (curve.width[n] - curve.width[p]) : 1.0f;
+		const float cu = block.cu[i] * w;
+		const float cb = block.cb[i] * w;
+		for (int c = 0; c < 3; ++c)
+		{
+			float pc = curve.P[c][p] + f * (curve.P[c][n] - curve.P[c][p]);
+			float up = curve.Up[c][p] + f * (curve.Up[c][n] - curve.Up[c][p]);
+			float bt = curve.B[c][p] + f * (curve.B[c][n] - curve.B[c][p]);
+			block.P[c][i] = pc + cu * up + cb * bt;
+			if (want_frames)
+			{
+				block.T[c][i] = curve.T[c][p] + f * (curve.T[c][n] - curve.T[c][p]);
+				block.B[c][i] = block.roll_cos[i] * bt - block.roll_sin[i] * up;
+				block.Up[c][i] = block.roll_sin[i] * bt + block.roll_cos[i] * up;
+			}
+		}
+	}
+}
+
+// Unit quaternion (w, x, y, z) of the rotation taking the x, y and z axes
+// to T, Up and B. The frame must be orthonormal and right handed.
+inline void
+frameToQuaternion(const float T[3], const float Up[3], const float B[3], float q[4])
+{
+	// Rotation matrix with T, Up, B as columns
+	const float m00 = T[0], m01 = Up[0], m02 = B[0];
+	const float m10 = T[1], m11 = Up[1], m12 = B[1];
+	const float m20 = T[2], m21 = Up[2], m22 = B[2];
+	const float trace = m00 + m11 + m22;
+	float s;
+	if (trace > 0.0f)
+	{
+		s = 2.0f * std::sqrt(trace + 1.0f);
+		q[0] = 0.25f * s;
+		q[1] = (m21 - m12) / s;
+		q[2] = (m02 - m20) / s;
+		q[3] = (m10 - m01) / s;
+	}
+	else if (m00 > m11 && m00 > m22)
+	{
+		s = 2.0f * std::sqrt(1.0f + m00 - m11 - m22);
+		q[0] = (m21 - m12) / s;
+		q[1] = 0.25f * s;
+		q[2] = (m01 + m10) / s;
+		q[3] = (m02 + m20) / s;
+	}
+	else if (m11 > m22)
+	{
+		s = 2.0f * std::sqrt(1.0f + m11 - m00 - m22);
+		q[0] = (m02 - m20) / s;
+		q[1] = (m01 + m10) / s;
+		q[2] = 0.25f * s;
+		q[3] = (m12 + m21) / s;
+	}
+	else
+	{
+		s = 2.0f * std::sqrt(1.0f + m22 - m00 - m11);
+		q[0] = (m10 - m01) / s;
+		q[1] = (m02 + m20) / s;
+		q[2] = (m12 + m21) / s;
+		q[3] = 0.25f * s;
+	}
+}
+
+// Spherical interpolation between the quaternions of samples p and n,
+// taking the short way around.
+inline void
+slerpFrameQuaternion(const CurveSamples &curve, int p, int n, float f, float q[4])
+{
+	float a[4], b[4];
+	float cosom = 0.0f;
+	for (int c = 0; c < 4; ++c)
+	{
+		a[c] = curve.Q[c][p];
+		b[c] = curve.Q[c][n];
+		cosom += a[c] * b[c];
+	}
+	if (cosom < 0.0f)
+	{
+		cosom = -cosom;
+		for (int c = 0; c < 4; ++c)
+			b[c] = -b[c];
+	}
+
+	float wa = 1.0f - f;
+	float wb = f;
+	if (cosom < 0.9995f)
+	{
+		const float omega = std::acos(cosom);
+		const float inv_sin = 1.0f / std::sin(omega);
+		wa = std::sin(wa * omega) * inv_sin;
+		wb = std::sin(wb * omega) * inv_sin;
+	}
+
+	// Nearly parallel quaternions fall back to a normalized lerp
+	float len = 0.0f;
+	for (int c = 0; c < 4; ++c)
+	{
+		q[c] = wa * a[c] + wb * b[c];
+		len += q[c] * q[c];
+	}
+	len = 1.0f / std::sqrt(len);
+	for (int c = 0; c < 4; ++c)
+		q[c] *= len;
+}
+
+// Stage 3 for cubic interpolation, scalar.
+inline void
+composeCubic(const CurveSamples &curve, const DeformParms &parms, bool want_frames,
+		DeformBlock &block)
+{
+	const int last = int(curve.num_points) - 1;
+	for (int i = 0; i < block.count; ++i)
+	{
+		const int p = block.idx[i];
+		const int n = p + 1;
+		// End tangents from the end segment, or across the seam of a closed
+		// curve, where sample last repeats sample 0
+		const int pp = p > 0 ? p - 1 : (curve.closed ? last - 1 : p);
+		const int nn = n < last ? n + 1 : (curve.closed ? 1 : n);
+		const float f = block.frac[i];
+		const float f2 = f * f;
+		const float f3 = f2 * f;
+		float w = parms.use_width ? curve.width[p] + f * (curve.width[n] - curve.width[p]) : 1.0f;
+		const float cu = block.cu[i] * w;
+		const float cb = block.cb[i] * w;
+
+		float q[4];
+		slerpFrameQuaternion(curve, p, n, f, q);
+		const float xx = q[1] * q[1], yy = q[2] * q[2], zz = q[3] * q[3];
+		const float xy = q[1] * q[2], xz = q[1] * q[3], yz = q[2] * q[3];
+		const float wx = q[0] * q[1], wy = q[0] * q[2], wz = q[0] * q[3];
+		const float tang[3] = {1.0f - 2.0f * (yy + zz), 2.0f * (xy + wz), 2.0f * (xz - wy)};
+		const float up[3] = {2.0f * (xy - wz), 1.0f - 2.0f * (xx + zz), 2.0f * (yz + wx)};
+		const float bt[3] = {2.0f * (xz + wy), 2.0f * (yz - wx), 1.0f - 2.0f * (xx + yy)};
+
+		for (int c = 0; c < 3; ++c)
+		{
+			// Uniform Catmull-Rom through the samples
+			const float *P = curve.P[c];
+			const float p0 = P[pp], p1 = P[p], p2 = P[n], p3 = P[nn];
+			const float pc = 0.5f * (2.0f * p1 + (p2 - p0) * f
+					+ (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * f2
+					+ (3.0f * (p1 - p2) + p3 - p0) * f3);
+			block.P[c][i] = pc + cu * up[c] + cb * bt[c];
+			if (want_frames)
+			{
+				block.T[c][i] = tang[c];
+				block.B[c][i] = block.roll_cos[i] * bt[c] - block.roll_sin[i] * up[c];
+				block.Up[c][i] = block.roll_sin[i] * bt[c] + block.roll_cos[i] * up[c];
+			}
+		}
+	}
+}
+
+#if defined(PATHDEFORM_X86_SIMD)
+
+PATHDEFORM_TARGET_SSE41 inline void
+lookupSSE(const CurveSamples &curve, DeformBlock &block)
+{
+	const int simd_end = block.count & ~3;
+	const float *arclen = curve.arclen;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 length = _mm_set1_ps(arclen[curve.num_points - 1]);
+	const __m128 scale = _mm_set1_ps(curve.bucket_scale);
+	const __m128i max_bucket = _mm_set1_epi32(int(curve.num_buckets) - 1);
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (int i = 0; i < simd_end; i += 4)
+	{
+		__m128 d = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(block.dist + i), zero), length);
+		__m128i b = _mm_slli_epi32(_mm_min_epi32(_mm_cvttps_epi32(_mm_mul_ps(d, scale)), max_bucket), 1);
+		int *p = block.idx + i;
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(p), b);
+		const int *r0 = curve.bucket + p[0], *r1 = curve.bucket + p[1];
+		const int *r2 = curve.bucket + p[2], *r3 = curve.bucket + p[3];
+		__m128i pv = _mm_setr_epi32(r0[0], r1[0], r2[0], r3[0]);
+		__m128i n = _mm_setr_epi32(r0[1], r1[1], r2[1], r3[1]);
+		__m128i max_n = _mm_max_epi32(n, _mm_shuffle_epi32(n, _MM_SHUFFLE(1, 0, 3, 2)));
+		max_n = _mm_max_epi32(max_n, _mm_shuffle_epi32(max_n, _MM_SHUFFLE(2, 3, 0, 1)));
+		for (int steps = _mm_cvtsi128_si32(max_n); steps > 1; steps -= steps >> 1)
+		{
+			// Compare masks are -1 in the lanes that move up
+			__m128i half = _mm_srli_epi32(n, 1);
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(p), _mm_add_epi32(pv, half));
+			__m128 probe = _mm_setr_ps(arclen[p[0]], arclen[p[1]], arclen[p[2]], arclen[p[3]]);
+			pv = _mm_add_epi32(pv, _mm_and_si128(half, _mm_castps_si128(_mm_cmple_ps(probe, d))));
+			n = _mm_sub_epi32(n, half);
+		}
+		pv = _mm_andnot_si128(_mm_castps_si128(_mm_cmple_ps(d, zero)), pv);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(p), pv);
+		__m128 a = _mm_setr_ps(arclen[p[0]], arclen[p[1]], arclen[p[2]], arclen[p[3]]);
+		__m128 next = _mm_setr_ps(arclen[p[0] + 1], arclen[p[1] + 1], arclen[p[2] + 1], arclen[p[3] + 1]);
+		__m128 seg = _mm_sub_ps(next, a);
+		__m128 frac = _mm_blendv_ps(_mm_and_ps(_mm_cmpge_ps(d, length), one),
+				_mm_div_ps(_mm_sub_ps(d, a), seg), _mm_cmpgt_ps(seg, zero));
+		_mm_storeu_ps(block.frac + i, frac);
+	}
+	lookupScalar(curve, simd_end, block);
+}
+
+PATHDEFORM_TARGET_SSE41 inline __m128
+gatherLerpSSE(const float *src, const int *p, __m128 f)
+{
+	__m128 a = _mm_setr_ps(src[p[0]], src[p[1]], src[p[2]], src[p[3]]);
+	__m128 b = _mm_setr_ps(src[p[0] + 1], src[p[1] + 1], src[p[2] + 1], src[p[3] + 1]);
+	return _mm_add_ps(a, _mm_mul_ps(f, _mm_sub_ps(b, a)));
+}
+
+PATHDEFORM_TARGET_SSE41 inline void
+composeSSE(const CurveSamples &curve, const DeformParms &parms, bool want_frames,
+		DeformBlock &block)
+{
+	const int simd_end = block.count & ~3;
+	for (int i = 0; i < simd_end; i += 4)
+	{
+		const int *p = block.idx + i;
+		__m128 f = _mm_loadu_ps(block.frac + i);
+		__m128 w = parms.use_width ? gatherLerpSSE(curve.width, p, f) : _mm_set1_ps(1.0f);
+		__m128 cu = _mm_mul_ps(_mm_loadu_ps(block.cu + i), w);
+		__m128 cb = _mm_mul_ps(_mm_loadu_ps(block.cb + i), w);
+		__m128 rc = _mm_loadu_ps(block.roll_cos + i);
+		__m128 rs = _mm_loadu_ps(block.roll_sin + i);
+		for (int c = 0; c < 3; ++c)
+		{
+			__m128 pc = gatherLerpSSE(curve.P[c], p, f);
+			__m128 up = gatherLerpSSE(curve.Up[c], p, f);
+			__m128 bt = gatherLerpSSE(curve.B[c], p, f);
+			pc = _mm_add_ps(pc, _mm_add_ps(_mm_mul_ps(cu, up), _mm_mul_ps(cb, bt)));
+			_mm_storeu_ps(block.P[c] + i, pc);
+			if (want_frames)
+			{
+				_mm_storeu_ps(block.T[c] + i, gatherLerpSSE(curve.T[c], p, f));
+				_mm_storeu_ps(block.B[c] + i, _mm_sub_ps(_mm_mul_ps(rc, bt), _mm_mul_ps(rs, up)));
+				_mm_storeu_ps(block.Up[c] + i, _mm_add_ps(_mm_mul_ps(rs, bt), _mm_mul_ps(rc, up)));
+			}
+		}
+	}
+	composeScalar(curve, parms, want_frames, simd_end, block);
+}
+
+PATHDEFORM_TARGET_AVX2 inline void
+lookupAVX2(const CurveSamples &curve, DeformBlock &block)
+{
+	const int simd_end = block.count & ~7;
+	const float *arclen = curve.arclen;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 length = _mm256_set1_ps(arclen[curve.num_points - 1]);
+	const __m256 scale = _mm256_set1_ps(curve.bucket_scale);
+	const __m256i max_bucket = _mm256_set1_epi32(int(curve.num_buckets) - 1);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256 one_ps = _mm256_set1_ps(1.0f);
+	for (int i = 0; i < simd_end; i += 8)
+	{
+		__m256 d = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(block.dist + i), zero), length);
+		__m256i b = _mm256_slli_epi32(_mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(d, scale)), max_bucket), 1);
+		__m256i p = _mm256_i32gather_epi32(curve.bucket, b, 4);
+		__m256i n = _mm256_i32gather_epi32(curve.bucket + 1, b, 4);
+
+		// The widest bucket among the lanes sets the number of halvings
+		__m256i max_n = _mm256_max_epi32(n, _mm256_shuffle_epi32(n, _MM_SHUFFLE(1, 0, 3, 2)));
+		max_n = _mm256_max_epi32(max_n, _mm256_shuffle_epi32(max_n, _MM_SHUFFLE(2, 3, 0, 1)));
+		max_n = _mm256_max_epi32(max_n, _mm256_permute2x128_si256(max_n, max_n, 1));
+		for (int steps = _mm256_cvtsi256_si32(max_n); steps > 1; steps -= steps >> 1)
+		{
+			// Compare masks are -1 in the lanes that move up
+			__m256i half = _mm256_srli_epi32(n, 1);
+			__m256 probe = _mm256_i32gather_ps(arclen, _mm256_add_epi32(p, half), 4);
+			p = _mm256_add_epi32(p, _mm256_and_si256(half,
+					_mm256_castps_si256(_mm256_cmp_ps(probe, d, _CMP_LE_OQ))));
+			n = _mm256_sub_epi32(n, half);
+		}
+		p = _mm256_andnot_si256(_mm256_castps_si256(_mm256_cmp_ps(d, zero, _CMP_LE_OQ)), p);
+		__m256 a = _mm256_i32gather_ps(arclen, p, 4);
+		__m256 seg = _mm256_sub_ps(_mm256_i32gather_ps(arclen, _mm256_add_epi32(p, one), 4), a);
+		__m256 frac = _mm256_blendv_ps(_mm256_and_ps(_mm256_cmp_ps(d, length, _CMP_GE_OQ), one_ps),
+				_mm256_div_ps(_mm256_sub_ps(d, a), seg), _mm256_cmp_ps(seg, zero, _CMP_GT_OQ));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(block.idx + i), p);
+		_mm256_storeu_ps(block.frac + i, frac);
+	}
+	lookupScalar(curve, simd_end, block);
+}
+
+PATHDEFORM_TARGET_AVX2 inline __m256
+gatherLerpAVX2(const float *src, __m256i p, __m256i n, __m256 f)
+{
+	__m256 a = _mm256_i32gather_ps(src, p, 4);
+	__m256 b = _mm256_i32gather_ps(src, n, 4);
+	return _mm256_fmadd_ps(f, _mm256_sub_ps(b, a), a);
+}
+
+PATHDEFORM_TARGET_AVX2 inline void
+composeAVX2(const CurveSamples &curve, const DeformParms &parms, bool want_frames,
+		DeformBlock &block)
+{
+	const int simd_end = block.count & ~7;
+	const __m256i one = _mm256_set1_epi32(1);
+	for (int i = 0; i < simd_end; i += 8)
+	{
+		__m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block.idx + i));
+		__m256i n = _mm256_add_epi32(p, one);
+		__m256 f = _mm256_loadu_ps(block.frac + i);
+		__m256 w = parms.use_width ? gatherLerpAVX2(curve.width, p, n, f) : _mm256_set1_ps(1.0f);
+		__m256 cu = _mm256_mul_ps(_mm256_loadu_ps(block.cu + i), w);
+		__m256 cb = _mm256_mul_ps(_mm256_loadu_ps(block.cb + i), w);
+		__m256 rc = _mm256_loadu_ps(block.roll_cos + i);
+		__m256 rs = _mm256_loadu_ps(block.roll_sin + i);
+		for (int c = 0; c < 3; ++c)
+		{
+			__m256 pc = gatherLerpAVX2(curve.P[c], p, n, f);
+			__m256 up = gatherLerpAVX2(curve.Up[c], p, n, f);
+			__m256 bt = gatherLerpAVX2(curve.B[c], p, n, f);
+			pc = _mm256_fmadd_ps(cu, up, _mm256_fmadd_ps(cb, bt, pc));
+			_mm256_storeu_ps(block.P[c] + i, pc);
+			if (want_frames)
+			{
+				_mm256_storeu_ps(block.T[c] + i, gatherLerpAVX2(curve.T[c], p, n, f));
+				_mm256_storeu_ps(block.B[c] + i, _mm256_fmsub_ps(rc, bt, _mm256_mul_ps(rs, up)));
+				_mm256_storeu_ps(block.Up[c] + i, _mm256_fmadd_ps(rs, bt, _mm256_mul_ps(rc, up)));
+			}
+		}
+	}
+	composeScalar(curve, parms, want_frames, simd_end, block);
+}
+
+#endif // PATHDEFORM_X86_SIMD
+
+// Best instruction set supported by the running CPU.
+inline KernelISA
+detectKernelISA()
+{
+#if defined(PATHDEFORM_X86_SIMD) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	const int max_leaf = info[0];
+	__cpuid(info, 1);
+	const bool sse41 = (info[2] & (1 << 19)) != 0;
+	const bool fma = (info[2] & (1 << 12)) != 0;
+	const bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28))
+			&& (_xgetbv(0) & 6) == 6;
+	bool avx2 = false;
+	if (max_leaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+	if (avx2 && fma && os_avx)
+		return KERNEL_AVX2;
+	return sse41 ? KERNEL_SSE41 : KERNEL_SCALAR;
+#elif defined(PATHDEFORM_X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return KERNEL_AVX2;
+	return __builtin_cpu_supports("sse4.1") ? KERNEL_SSE41 : KERNEL_SCALAR;
+#else
+	return KERNEL_SCALAR;
+#endif
+}
+
+// Resolve a requested instruction set against what the CPU supports.
+inline KernelISA
+resolveKernelISA(KernelISA requested)
+{
+	static const KernelISA supported = detectKernelISA();
+	if (requested == KERNEL_AUTO || requested > supported)
+		return supported;
+	return requested;
+}
+
+// Stage 2 dispatch. isa must be resolved. Closed curves take the distance
+// modulo their length first, as d - len * floor(d / len) so the loop has
+// no branch.
+inline void
+lookupBlock(const CurveSamples &curve, KernelISA isa, DeformBlock &block)
+{
+	if (curve.closed)
+	{
+		const float length = curve.arclen[curve.num_points - 1];
+		const float inv_length = length > 0.0f ? 1.0f / length : 0.0f;
+		for (int i = 0; i < block.count; ++i)
+			block.dist[i] -= length * std::floor(block.dist[i] * inv_length);
+	}
+
+	switch (isa)
+	{
+#if defined(PATHDEFORM_X86_SIMD)
+	case KERNEL_AVX2:
+		lookupAVX2(curve, block);
+		break;
+	case KERNEL_SSE41:
+		lookupSSE(curve, block);
+		break;
+#endif
+	default:
+		lookupScalar(curve, 0, block);
+		break;
+	}
+}
+
+// Stage 3 dispatch. isa must be resolved.
+inline void
+composeBlock(const CurveSamples &curve, const DeformParms &parms, bool want_frames,
+		KernelISA isa, DeformBlock &block)
+{
+	if (parms.interpolation == INTERP_CUBIC)
+	{
+		composeCubic(curve, parms, want_frames, block);
+		return;
+	}
+
+	switch (isa)
+	{
+#if defined(PATHDEFORM_X86_SIMD)
+	case KERNEL_AVX2:
+		composeAVX2(curve, parms, want_frames, block);
+		break;
+	case KERNEL_SSE41:
+		composeSSE(curve, parms, want_frames, block);
+		break;
+#endif
+	default:
+		composeScalar(curve, parms, want_frames, 0, block);
+		break;
+	}
+}
+
+// Stage 4.
+inline void
+storeBlock(const DeformBlock &block, float *P)
+{
+	for (int i = 0; i < block.count; ++i)
+	{
+		P[3 * i + 0] = block.P[0][i];
+		P[3 * i + 1] = block.P[1][i];
+		P[3 * i + 2] = block.P[2][i];
+	}
+}
+
+// Deform count (<= BLOCK_SIZE) points from their projection, writing the
+// xyz triplets to P.
+inline void
+deformBlock(const CurveSamples &curve, const DeformParms &parms, bool want_frames,
+		KernelISA isa, const float *relpos, const float *cu, const float *cb,
+		float *P, int count, DeformBlock &block, const PointOverrides *overrides = nullptr)
+{
+	loadBlock(parms, relpos, cu, cb, count, block, overrides);
+	lookupBlock(curve, isa, block);
+	composeBlock(curve, parms, want_frames, isa, block);
+	storeBlock(block, P);
+}
+
+// Deform any number of contiguous points, block after block.
+inline void
+deformPoints(const CurveSamples &curve, const DeformParms &parms, KernelISA isa,
+		const float *relpos, const float *cu, const float *cb,
+		float *P, size_t count, DeformBlock &block)
+{
+	for (size_t i = 0; i < count; i += BLOCK_SIZE)
+	{
+		const int n = int(std::min(count - i, size_t(BLOCK_SIZE)));
+		deformBlock(curve, parms, false, isa, relpos + i, cu + i, cb + i, P + 3 * i, n, block);
+	}
+}
+
+// Rows of the curve basis of a point for the object axis laid along the
+// curve, the rotation from object space to the deformed frame.
+inline void
+curveBasis(int axis, const float T[3], const float B[3], const float Up[3], float m[3][3])
+{
+	for (int c = 0; c < 3; ++c)
+	{
+		switch (axis)
+		{
+			case 0:
+				m[0][c] = T[c]; m[1][c] = Up[c]; m[2][c] = -B[c];
+				break;
+			case 1:
+				m[0][c] = Up[c]; m[1][c] = T[c]; m[2][c] = B[c];
+				break;
+			default:
+				m[0][c] = B[c]; m[1][c] = Up[c]; m[2][c] = -T[c];
+				break;
+		}
+	}
+}
+
+// Rotate count vector attribute values (xyz triplets) in place by the
+// curve basis of every point of a deformed block, v * basis. The basis is
+// orthonormal, so the same transform is right for normals and no inverse
+// is needed.
+inline void
+reorientVectors(int axis, const DeformBlock &block, float *V, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		const float T[3] = {block.T[0][i], block.T[1][i], block.T[2][i]};
+		const float B[3] = {block.B[0][i], block.B[1][i], block.B[2][i]};
+		const float Up[3] = {block.Up[0][i], block.Up[1][i], block.Up[2][i]};
+		float m[3][3];
+		curveBasis(axis, T, B, Up, m);
+		float *v = V + 3 * i;
+		const float x = v[0], y = v[1], z = v[2];
+		for (int c = 0; c < 3; ++c)
+			v[c] = x * m[0][c] + y * m[1][c] + z * m[2][c];
+	}
+}
+
+// Compose count orientation quaternions (x, y, z, w as stored in GA) with
+// the curve basis of every point. The basis of the x and y axes is a mirror,
+// which a quaternion can't hold, so its third row is flipped: the object
+// axis still follows the tangent and y the up vector.
+inline void
+reorientQuaternions(int axis, const DeformBlock &block, float *Q, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		const float T[3] = {block.T[0][i], block.T[1][i], block.T[2][i]};
+		const float B[3] = {block.B[0][i], block.B[1][i], block.B[2][i]};
+		const float Up[3] = {block.Up[0][i], block.Up[1][i], block.Up[2][i]};
+		float m[3][3];
+		curveBasis(axis, T, B, Up, m);
+		if (axis < 2)
+		{
+			for (int c = 0; c < 3; ++c)
+				m[2][c] = -m[2][c];
+		}
+
+		// Rows of the basis are the images of the object axes
+		float r[4];
+		frameToQuaternion(m[0], m[1], m[2], r);
+		float *q = Q + 4 * i;
+		const float x = q[0], y = q[1], z = q[2], w = q[3];
+		q[0] = r[0] * x + r[1] * w + r[2] * z - r[3] * y;
+		q[1] = r[0] * y - r[1] * z + r[2] * w + r[3] * x;
+		q[2] = r[0] * z + r[1] * y - r[2] * x + r[3] * w;
+		q[3] = r[0] * w - r[1] * x - r[2] * y - r[3] * z;
+	}
+}
+
+// Rotation minimizing frames, double reflection method (Wang et al. 2008).
+// The two reflections that carry the frame from one curve sample to the next
+// only depend on the curve, so each segment reduces to a rotation quaternion
+// and the frame at sample k is the product of the first k of them. Products
+// are associative, so the SOP evaluates them with a parallel prefix scan.
+struct FrameRotation
+{
+	double w, x, y, z;
+};
+
+inline FrameRotation
+frameRotationIdentity()
+{
+	FrameRotation q = {1.0, 0.0, 0.0, 0.0};
+	return q;
+}
+
+// a * b, rotates by b first.
+inline FrameRotation
+frameRotationProduct(const FrameRotation &a, const FrameRotation &b)
+{
+	FrameRotation q;
+	q.w = a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z;
+	q.x = a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y;
+	q.y = a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x;
+	q.z = a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w;
+	return q;
+}
+
+inline void
+frameRotationApply(const FrameRotation &q, const double v[3], double out[3])
+{
+	// v + 2w (u x v) + 2 u x (u x v), u the vector part
+	const double tx = 2.0 * (q.y * v[2] - q.z * v[1]);
+	const double ty = 2.0 * (q.z * v[0] - q.x * v[2]);
+	const double tz = 2.0 * (q.x * v[1] - q.y * v[0]);
+	out[0] = v[0] + q.w * tx + (q.y * tz - q.z * ty);
+	out[1] = v[1] + q.w * ty + (q.z * tx - q.x * tz);
+	out[2] = v[2] + q.w * tz + (q.x * ty - q.y * tx);
+}
+
+// Shortest arc rotation from unit vector a to unit vector b.
+inline FrameRotation
+frameRotationBetween(const double a[3], const double b[3])
+{
+	FrameRotation q;
+	q.w = 1.0 + a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	q.x = a[1] * b[2] - a[2] * b[1];
+	q.y = a[2] * b[0] - a[0] * b[2];
+	q.z = a[0] * b[1] - a[1] * b[0];
+	const double len = std::sqrt(q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z);
+	if (q.w < 1e-12 || len <= 0.0)
+		return frameRotationIdentity(); // opposite or degenerate tangents
+	q.w /= len; q.x /= len; q.y /= len; q.z /= len;
+	return q;
+}
+
+// Rotation carrying the frame from sample i to sample i + 1. P and T are the
+// sample positions and unit tangents, one array per component.
+inline FrameRotation
+segmentFrameRotation(const float *const P[3], const float *const T[3], unsigned int i)
+{
+	const unsigned int n = i + 1;
+	double v1[3], ti[3], tn[3];
+	for (int c = 0; c < 3; ++c)
+	{
+		v1[c] = double(P[c][n]) - P[c][i];
+		ti[c] = T[c][i];
+		tn[c] = T[c][n];
+	}
+
+	// First reflection, across the plane bisecting the segment
+	const double c1 = v1[0] * v1[0] + v1[1] * v1[1] + v1[2] * v1[2];
+	if (c1 <= 1e-20)
+		return frameRotationBetween(ti, tn);
+	double tl[3], v2[3];
+	const double d1 = 2.0 * (v1[0] * ti[0] + v1[1] * ti[1] + v1[2] * ti[2]) / c1;
+	for (int c = 0; c < 3; ++c)
+	{
+		tl[c] = ti[c] - d1 * v1[c];
+		v2[c] = tn[c] - tl[c];
+	}
+
+	// Second reflection, mapping the reflected tangent onto the next one
+	const double c2 = v2[0] * v2[0] + v2[1] * v2[1] + v2[2] * v2[2];
+	if (c2 <= 1e-20)
+		return frameRotationBetween(ti, tn);
+
+	// Two reflections across planes with unit normals n1 then n2 are the
+	// rotation n2 * n1 in pure quaternions: (-n2.n1, n2 x n1)
+	const double l1 = 1.0 / std::sqrt(c1);
+	const double l2 = 1.0 / std::sqrt(c2);
+	const double n1[3] = {v1[0] * l1, v1[1] * l1, v1[2] * l1};
+	const double n2[3] = {v2[0] * l2, v2[1] * l2, v2[2] * l2};
+	FrameRotation q;
+	q.w = -(n2[0] * n1[0] + n2[1] * n1[1] + n2[2] * n1[2]);
+	q.x = n2[1] * n1[2] - n2[2] * n1[1];
+	q.y = n2[2] * n1[0] - n2[0] * n1[2];
+	q.z = n2[0] * n1[1] - n2[1] * n1[0];
+	return q;
+}
+
+inline void *
+alignedAlloc(size_t size, size_t alignment)
+{
+#if defined(_MSC_VER)
+	return _aligned_malloc(size, alignment);
+#else
+	void *ptr = nullptr;
+	return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+#endif
+}
+
+inline void
+alignedFree(void *ptr)
+{
+#if defined(_MSC_VER)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+// Curve samples packed into contiguous, aligned structure-of-arrays buffers,
+// so the deform kernel reads plain floats. Several curves are stored back to
+// back; each one is addressed by its first sample and sample count.
+class CurveCache
+{
+public:
+	CurveCache()
+		: data(nullptr), num_points(0), capacity(0)
+	{
+		resize(nullptr, 0);
+	}
+
+	~CurveCache()
+	{
+		alignedFree(data);
+	}
+
+	// Grows the buffers only when the total point count exceeds what
+	// previous calls allocated. Closed curves count their first point twice,
+	// at both ends.
+	void
+	resize(const unsigned int *curve_num_points, size_t num_curves,
+			const unsigned char *closed = nullptr)
+	{
+		unsigned int npoints = 0;
+		curve_start.resize(num_curves);
+		curve_entries.assign(curve_num_points, curve_num_points + num_curves);
+		curve_closed.assign(num_curves, 0);
+		if (closed)
+			curve_closed.assign(closed, closed + num_curves);
+		curve_tangents.assign(num_curves, 0);
+		curve_buckets.resize(num_curves);
+		curve_bucket_scale.assign(num_curves, 0.0f);
+		for (size_t i = 0; i < num_curves; ++i)
+		{
+			curve_start[i] = npoints;
+			npoints += curve_num_points[i];
+		}
+
+		num_points = npoints;
+		if (data && npoints <= capacity)
+			return; // reuse the buffers of previous cooks
+
+		// Every channel padded to a multiple of 8 floats so it starts on a
+		// 32 byte boundary.
+		float **channels[] = {&P[0], &P[1], &P[2], &T[0], &T[1], &T[2],
+				&B[0], &B[1], &B[2], &Up[0], &Up[1], &Up[2], &Q[0], &Q[1], &Q[2], &Q[3],
+				&width, &twist, &arclen};
+		const size_t num_channels = sizeof(channels) / sizeof(channels[0]);
+		const size_t stride = std::max((size_t(npoints) + 7) & ~size_t(7), size_t(8));
+		alignedFree(data);
+		data = static_cast<float *>(alignedAlloc(stride * num_channels * sizeof(float), 32));
+		capacity = stride;
+
+		float *channel = data;
+		for (size_t i = 0; i < num_channels; ++i, channel += stride)
+			*channels[i] = channel;
+	}
+
+	unsigned int entries() const { return num_points; }
+	size_t numCurves() const { return curve_start.size(); }
+	unsigned int curveStart(size_t curve) const { return curve_start[curve]; }
+	unsigned int curveEntries(size_t curve) const { return curve_entries[curve]; }
+	bool curveClosed(size_t curve) const { return curve_closed[curve] != 0; }
+
+	// Curves packed with their own tangents in T keep them, the frames are
+	// built around them instead of finite differences.
+	bool curveTangents(size_t curve) const { return curve_tangents[curve] != 0; }
+	void setCurveTangents(size_t curve, bool given) { curve_tangents[curve] = given; }
+
+	float
+	curveLength(size_t curve) const
+	{
+		unsigned int npts = curve_entries[curve];
+		return npts ? arclen[curve_start[curve] + npts - 1] : 0.0f;
+	}
+
+	CurveSamples
+	samples(size_t curve) const
+	{
+		const unsigned int start = curve_start[curve];
+		CurveSamples samples;
+		for (int c = 0; c < 3; ++c)
+		{
+			samples.P[c] = P[c] + start;
+			samples.T[c] = T[c] + start;
+			samples.B[c] = B[c] + start;
+			samples.Up[c] = Up[c] + start;
+		}
+		for (int c = 0; c < 4; ++c)
+			samples.Q[c] = Q[c] + start;
+		samples.width = width + start;
+		samples.arclen = arclen + start;
+		samples.bucket = curve_buckets[curve].data();
+		samples.num_buckets = unsigned(curve_buckets[curve].size() / 2);
+		samples.bucket_scale = curve_bucket_scale[curve];
+		samples.num_points = curve_entries[curve];
+		samples.closed = curve_closed[curve] != 0;
+		return samples;
+	}
+
+	// Uniform arc length buckets of a curve, from its arclen, one per
+	// segment. A segment start falls in the bucket the lookup computes for
+	// it, with the same float math. That map is monotonic, so a distance
+	// ends in a segment from the last one starting in an earlier bucket up
+	// to the last one starting in its own, and no rounding guard is needed.
+	// Every bucket stores that first segment and the segment count.
+	void
+	buildArcLengthBuckets(size_t curve)
+	{
+		const unsigned int npts = curve_entries[curve];
+		const float *len = arclen + curve_start[curve];
+		std::vector<int> &bucket = curve_buckets[curve];
+		const float length = npts ? len[npts - 1] : 0.0f;
+		const float scale = npts > 1 ? (npts - 1) / length : 0.0f;
+		if (npts < 2 || !(length > 0.0f) || !std::isfinite(scale))
+		{
+			// Every distance maps to the start of the first segment
+			bucket.assign(2, 0);
+			bucket[1] = 1;
+			curve_bucket_scale[curve] = 0.0f;
+			return;
+		}
+
+		const int num_buckets = int(npts) - 1;
+		const int num_segs = int(npts) - 1;
+		bucket.resize(2 * size_t(num_buckets));
+		int before = 0;    // segments starting in earlier buckets
+		int upto = 0;      // segments starting in this bucket or earlier
+		for (int b = 0; b < num_buckets; ++b)
+		{
+			while (upto < num_segs && std::min(int(len[upto] * scale), num_buckets - 1) <= b)
+				++upto;
+			const int first = std::max(before - 1, 0);
+			bucket[2 * b] = first;
+			bucket[2 * b + 1] = upto - first;
+			before = upto;
+		}
+		curve_bucket_scale[curve] = scale;
+	}
+
+	float *P[3];
+	float *T[3];
+	float *B[3];
+	float *Up[3];
+	float *Q[4];     // frame quaternion (w, x, y, z)
+	float *width;
+	float *twist;
+	float *arclen;   // cumulative arc length at every curve point
+
+private:
+	CurveCache(const CurveCache &);
+	CurveCache &operator=(const CurveCache &);
+
+	float *data;
+	unsigned int num_points;
+	size_t capacity; // points per channel
+	std::vector<unsigned int> curve_start;
+	std::vector<unsigned int> curve_entries;
+	std::vector<unsigned char> curve_closed;
+	std::vector<unsigned char> curve_tangents;
+	std::vector<std::vector<int> > curve_buckets;
+	std::vector<float> curve_bucket_scale;
+};
+
+// Cumulative arc length of a curve from its packed positions.
+inline void
+computeArcLength(CurveCache &cache, size_t curve)
+{
+	const unsigned int start = cache.curveStart(curve);
+	const unsigned int npts = cache.curveEntries(curve);
+	float length = 0.0f;
+	for (unsigned int i = start; i < start + npts; ++i)
+	{
+		if (i > start)
+		{
+			const float dx = cache.P[0][i] - cache.P[0][i - 1];
+			const float dy = cache.P[1][i] - cache.P[1][i - 1];
+			const float dz = cache.P[2][i] - cache.P[2][i - 1];
+			length += std::sqrt(dx * dx + dy * dy + dz * dz);
+		}
+		cache.arclen[i] = length;
+	}
+	cache.buildArcLengthBuckets(curve);
+}
+
+enum FrameMode
+{
+	FRAME_UP_VECTOR = 0,        // bitangent from a fixed up vector or the curve normal
+	FRAME_ROTATION_MINIMIZING   // first frame transported along the curve without twisting
+};
+
+inline void
+normalize3(float v[3])
+{
+	const float len = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	if (len > 0.0f)
+	{
+		v[0] /= len; v[1] /= len; v[2] /= len;
+	}
+}
+
+inline void
+cross3(const float a[3], const float b[3], float out[3])
+{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// Adaptive samples of a smooth curve over its unit parameter range.
+// eval(u, P, D) writes the position and first derivative at u. Every span
+// between the num_spans + 1 uniform samples is halved while its midpoint is
+// further than tolerance from the chord or its end tangents turn more than
+// max_angle radians, at most max_depth times. Appends xyz triplets to P and
+// the unit derivatives to T, and the parameters to U.
+template <typename Eval>
+void
+bakeCurveSamples(Eval &&eval, unsigned int num_spans, float tolerance, float max_angle,
+		int max_depth, std::vector<float> &P, std::vector<float> &T, std::vector<float> &U)
+{
+	struct Sample
+	{
+		float u;
+		float P[3];
+		float T[3];
+	};
+	struct Span
+	{
+		Sample a, b;
+		int depth;
+	};
+	const float min_cos = std::cos(max_angle);
+
+	auto evaluate = [&](float u, Sample &sample)
+	{
+		sample.u = u;
+		eval(u, sample.P, sample.T);
+		normalize3(sample.T);
+	};
+	auto append = [&](const Sample &sample)
+	{
+		P.insert(P.end(), sample.P, sample.P + 3);
+		T.insert(T.end(), sample.T, sample.T + 3);
+		U.push_back(sample.u);
+	};
+
+	num_spans = std::max(num_spans, 1u);
+	Sample start;
+	evaluate(0.0f, start);
+	append(start);
+
+	// Depth first, left half on top, so samples come out in order
+	std::vector<Span> stack;
+	for (unsigned int span = 0; span < num_spans; ++span)
+	{
+		Span s;
+		s.a = start;
+		evaluate(float(span + 1) / num_spans, s.b);
+		s.depth = 0;
+		start = s.b;
+		stack.push_back(s);
+		while (!stack.empty())
+		{
+			Span top = stack.back();
+			stack.pop_back();
+
+			Sample mid;
+			evaluate(0.5f * (top.a.u + top.b.u), mid);
+			float dev = 0.0f;
+			for (int c = 0; c < 3; ++c)
+			{
+				const float d = mid.P[c] - 0.5f * (top.a.P[c] + top.b.P[c]);
+				dev += d * d;
+			}
+			const float cos_turn = top.a.T[0] * top.b.T[0] + top.a.T[1] * top.b.T[1]
+					+ top.a.T[2] * top.b.T[2];
+			if (top.depth < max_depth && (dev > tolerance * tolerance || cos_turn < min_cos))
+			{
+				Span left = {top.a, mid, top.depth + 1};
+				Span right = {mid, top.b, top.depth + 1};
+				stack.push_back(right);
+				stack.push_back(left);
+				continue;
+			}
+			append(top.b);
+		}
+	}
+}
+
+// Frames carried from the first sample by the prefix product of the segment
+// rotations. Three passes: running products inside fixed size chunks in
+// parallel, a serial pass over the chunk totals, then every chunk prefix
+// applied in parallel.
+template <typename ParallelFor>
+void
+computeRotationMinimizingFrames(CurveCache &cache, size_t curve, ParallelFor &&pfor)
+{
+	const unsigned int start = cache.curveStart(curve);
+	const unsigned int npts = cache.curveEntries(curve);
+	const unsigned int num_segments = npts - 1;
+	const unsigned int chunk_size = 4096;
+	const unsigned int num_chunks = (num_segments + chunk_size - 1) / chunk_size;
+	const float *P[3], *T[3];
+	for (int c = 0; c < 3; ++c)
+	{
+		P[c] = cache.P[c] + start;
+		T[c] = cache.T[c] + start;
+	}
+
+	// rotation[j] goes from the chunk start to sample j
+	std::vector<FrameRotation> rotation(npts);
+	std::vector<FrameRotation> chunk_prefix(num_chunks);
+	pfor(0u, num_chunks, 1u, [&](unsigned int begin, unsigned int end)
+	{
+		for (unsigned int chunk = begin; chunk < end; ++chunk)
+		{
+			const unsigned int last = std::min((chunk + 1) * chunk_size, num_segments);
+			FrameRotation q = frameRotationIdentity();
+			for (unsigned int seg = chunk * chunk_size; seg < last; ++seg)
+			{
+				q = frameRotationProduct(segmentFrameRotation(P, T, seg), q);
+				rotation[seg + 1] = q;
+			}
+		}
+	});
+
+	FrameRotation total = frameRotationIdentity();
+	for (unsigned int chunk = 0; chunk < num_chunks; ++chunk)
+	{
+		chunk_prefix[chunk] = total;
+		const unsigned int last = std::min((chunk + 1) * chunk_size, num_segments);
+		total = frameRotationProduct(rotation[last], total);
+	}
+
+	const double up0[3] = {cache.Up[0][start], cache.Up[1][start], cache.Up[2][start]};
+	pfor(0u, num_chunks, 1u, [&](unsigned int begin, unsigned int end)
+	{
+		for (unsigned int chunk = begin; chunk < end; ++chunk)
+		{
+			const unsigned int last = std::min((chunk + 1) * chunk_size, num_segments);
+			for (unsigned int seg = chunk * chunk_size; seg < last; ++seg)
+			{
+				const unsigned int i = start + seg + 1;
+				double rotated[3];
+				frameRotationApply(frameRotationProduct(rotation[seg + 1], chunk_prefix[chunk]),
+						up0, rotated);
+
+				// Orthonormalize against the tangent, rounding accumulates
+				// over long curves
+				const float tang[3] = {T[0][seg + 1], T[1][seg + 1], T[2][seg + 1]};
+				float up[3] = {float(rotated[0]), float(rotated[1]), float(rotated[2])};
+				float btang[3];
+				cross3(tang, up, btang);
+				normalize3(btang);
+				cross3(btang, tang, up);
+				for (int c = 0; c < 3; ++c)
+				{
+					cache.B[c][i] = btang[c];
+					cache.Up[c][i] = up[c];
+				}
+			}
+		}
+	});
+}
+
+// Frames of a curve from its packed positions and twist. normal is the up
+// vector, or the curve normal, the bitangent is built from. Twist (degrees)
+// is applied here, the roll parameter is left to the deform kernel so frames
+// survive roll changes. Every frame is also stored as a quaternion for
+// cubic interpolation.
+template <typename ParallelFor>
+void
+computeCurveFrames(CurveCache &cache, size_t curve, int frame_mode, bool use_twist,
+		const float normal[3], ParallelFor &&pfor)
+{
+	const unsigned int start = cache.curveStart(curve);
+	const unsigned int npts = cache.curveEntries(curve);
+	const bool closed = cache.curveClosed(curve) && npts > 2;
+	const bool given_tangents = cache.curveTangents(curve);
+	float avg_normal[3] = {normal[0], normal[1], normal[2]};
+	normalize3(avg_normal);
+
+	// Tangents and up vector frames, every point on its own
+	pfor(0u, npts, 1024u, [&](unsigned int begin, unsigned int end)
+	{
+		for (unsigned int j = begin; j < end; ++j)
+		{
+			const unsigned int i = start + j;
+			// Neighbours in vertex order, one sided at the ends of open
+			// curves. Closed curves repeat sample 0 as the last one, both
+			// ends look across the seam.
+			unsigned int prev = start + (j > 0 ? j - 1 : 0);
+			unsigned int next = start + std::min(j + 1, npts - 1);
+			if (closed && j == 0)
+				prev = start + npts - 2;
+			if (closed && j == npts - 1)
+				next = start + 1;
+			float tang[3], btang[3], up[3];
+			for (int c = 0; c < 3; ++c)
+				tang[c] = given_tangents ? cache.T[c][i] : cache.P[c][prev] - cache.P[c][next];
+			normalize3(tang);
+			cross3(tang, avg_normal, btang);
+			normalize3(btang);
+			cross3(btang, tang, up);
+			for (int c = 0; c < 3; ++c)
+			{
+				cache.T[c][i] = tang[c];
+				cache.B[c][i] = btang[c];
+				cache.Up[c][i] = up[c];
+			}
+		}
+	});
+
+	// Keep the first frame and carry it along the curve
+	double closure = 0.0;
+	if (frame_mode == FRAME_ROTATION_MINIMIZING && npts > 1)
+	{
+		computeRotationMinimizingFrames(cache, curve, pfor);
+
+		// The frame carried around a closed curve comes back rotated about
+		// the tangent. That angle is spread over the curve by arc length so
+		// the last frame matches the first again.
+		const unsigned int last = start + npts - 1;
+		const float length = cache.arclen[last];
+		if (closed && length > 0.0f)
+		{
+			const float tang[3] = {cache.T[0][start], cache.T[1][start], cache.T[2][start]};
+			const float up0[3] = {cache.Up[0][start], cache.Up[1][start], cache.Up[2][start]};
+			const float up1[3] = {cache.Up[0][last], cache.Up[1][last], cache.Up[2][last]};
+			float axis[3];
+			cross3(up1, up0, axis);
+			const double sin_angle = axis[0] * tang[0] + axis[1] * tang[1] + axis[2] * tang[2];
+			const double cos_angle = up1[0] * up0[0] + up1[1] * up0[1] + up1[2] * up0[2];
+			closure = std::atan2(sin_angle, cos_angle) * (180.0 / 3.14159265358979323846) / length;
+		}
+	}
+
+	pfor(0u, npts, 1024u, [&](unsigned int begin, unsigned int end)
+	{
+		for (unsigned int j = begin; j < end; ++j)
+		{
+			const unsigned int i = start + j;
+			const float tang[3] = {cache.T[0][i], cache.T[1][i], cache.T[2][i]};
+			float btang[3] = {cache.B[0][i], cache.B[1][i], cache.B[2][i]};
+			float up[3] = {cache.Up[0][i], cache.Up[1][i], cache.Up[2][i]};
+			const double angle = (use_twist ? cache.twist[i] : 0.0) + closure * cache.arclen[i];
+			if (angle != 0.0)
+			{
+				const double half = 0.5 * angle * (3.14159265358979323846 / 180.0);
+				const double s = std::sin(half);
+				const FrameRotation twist = {std::cos(half), s * tang[0], s * tang[1], s * tang[2]};
+				double src[3], dst[3];
+				for (int c = 0; c < 3; ++c)
+					src[c] = btang[c];
+				frameRotationApply(twist, src, dst);
+				for (int c = 0; c < 3; ++c)
+				{
+					btang[c] = float(dst[c]);
+					src[c] = up[c];
+				}
+				frameRotationApply(twist, src, dst);
+				for (int c = 0; c < 3; ++c)
+				{
+					up[c] = float(dst[c]);
+					cache.B[c][i] = btang[c];
+					cache.Up[c][i] = up[c];
+				}
+			}
+
+			float quat[4];
+			frameToQuaternion(tang, up, btang, quat);
+			for (int c = 0; c < 4; ++c)
+				cache.Q[c][i] = quat[c];
+		}
+	});
+}
+
+} // namespace pathdeform
+
+#endif /* PATHDEFORM_CORE_H_ */
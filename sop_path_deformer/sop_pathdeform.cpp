@@ -18,16 +18,30 @@
 #include <GA/GA_PageIterator.h>
 #include <GA/GA_PageHandle.h>
 #include <OP/OP_OperatorTable.h>
+#include <OP/OP_Director.h>
+#include <OP/OP_Utils.h>
+#include <CH/CH_Manager.h>
 #include <GEO/GEO_Primitive.h>
 #include <GEO/GEO_PrimTypeCompat.h>
 #include <GEO/GEO_PrimType.h>
 #include <GEO/GEO_Curve.h>
+#include <GEO/GEO_Face.h>
 #include <GOP/GOP_AttribListParse.h>
 #include <GU/GU_Curve.h>
+#include <GU/GU_PrimPacked.h>
 #include <PRM/PRM_Include.h>
 #include <SYS/SYS_Math.h>
 #include <UT/UT_Vector3.h>
 #include <UT/UT_ParallelUtil.h>
+#include <UT/UT_Map.h>
+#include <UT/UT_BoundingBox.h>
+#include <UT/UT_Thread.h>
+#include <UT/UT_Lock.h>
+#include <OP/OP_NodeInfoParms.h>
+#include <UT/UT_ThreadSpecificValue.h>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
 #include "sop_pathdeform.h"
 
 
@@ -43,10 +57,24 @@ OP_Node *PathDeform::MyConstructor(OP_Network *net, const char *name, OP_Operato
 PathDeform::PathDeform(OP_Network *net, const char *name, OP_Operator *op)
 :SOP_Node(net, name, op)
 {
+	// The cook bumps the data IDs of what it writes, so the output copy
+	// cache can match the output topology on the next cook
+	mySopFlags.setManagesDataIDs(true);
 }
 
 PathDeform::~PathDeform() {};
 
+// Runs the sample loops of the deformation core on the Houdini thread pool.
+struct UTParallelForAdapter
+{
+	template <typename Body>
+	void operator()(unsigned int begin, unsigned int end, unsigned int grain, const Body &body) const
+	{
+		UTparallelFor(UT_BlockedRange<unsigned int>(begin, end, grain),
+			[&](const UT_BlockedRange<unsigned int> &r) { body(r.begin(), r.end()); });
+	}
+};
+
 static PRM_Name useUpVector("use_up_vector", "Use Up-Vector");
 static PRM_Name useCurveTwist("use_curve_twist", "Use Twist Attribute");
 static PRM_Name useCurveWidth("use_curve_width", "Scale By Width Attribute");
@@ -55,19 +83,93 @@ static PRM_Name stretch_tolen("stretch_to_len", "Stretch To Length");
 static PRM_Name vecAttribs("vattribs", "Vector Attributes");
 static PRM_Name deformVattribs("deform_vattribs", "Deform Vector Attributes");
 static PRM_Name recompute_normals("recompute_n", "Recompute Point Normals");
+static PRM_Name normalMode("normal_mode", "Normals");
+static PRM_Name normalModeMenuNames[] =
+{
+	PRM_Name("rotate", "Fast (Rotate By Curve Frames)"),
+	PRM_Name("recompute", "Accurate (Recompute From Primitives)"),
+	PRM_Name(0)
+};
+static PRM_ChoiceList normalModeMenu(PRM_CHOICELIST_SINGLE, normalModeMenuNames);
 static PRM_Name addBasisAttr("add_basis_attribs", "Add Basis Attribs To Points");
 
+static PRM_Name frameMode("frame_mode", "Frames");
+static PRM_Name frameModeMenuNames[] =
+{
+	PRM_Name("upvector", "Up Vector"),
+	PRM_Name("rmf", "Rotation Minimizing"),
+	PRM_Name(0)
+};
+static PRM_ChoiceList frameModeMenu(PRM_CHOICELIST_SINGLE, frameModeMenuNames);
+
+static PRM_Name interpolation("interpolation", "Interpolation");
+static PRM_Name interpolationMenuNames[] =
+{
+	PRM_Name("linear", "Linear"),
+	PRM_Name("cubic", "Cubic"),
+	PRM_Name(0)
+};
+static PRM_ChoiceList interpolationMenu(PRM_CHOICELIST_SINGLE, interpolationMenuNames);
+static PRM_Name curveTolerance("curve_tolerance", "Spline Sample Tolerance");
+static PRM_Default curveToleranceDefault(0.001);
+static PRM_Range curveToleranceRange(PRM_RANGE_RESTRICTED, 0.00001, PRM_RANGE_UI, 0.01);
+
+static PRM_Name deformMode("deform_mode", "Deform");
+static PRM_Name deformModeMenuNames[] =
+{
+	PRM_Name("points", "Points"),
+	PRM_Name("packed", "Packed Primitives"),
+	PRM_Name("instances", "Instance Points (orient)"),
+	PRM_Name(0)
+};
+static PRM_ChoiceList deformModeMenu(PRM_CHOICELIST_SINGLE, deformModeMenuNames);
+
+static PRM_Name kernelName("kernel", "Deform Kernel");
+static PRM_Name multiCurve("multi_curve", "Deform Pieces Along Curves");
+static PRM_Name pieceAttrib("piece_attrib", "Piece Attribute");
+static PRM_Default pieceAttribDefault(0, "class");
+
+static PRM_Name kernelMenuNames[] =
+{
+	PRM_Name("auto", "Auto Detect"),
+	PRM_Name("scalar", "Scalar"),
+	PRM_Name("sse41", "SSE4.1"),
+	PRM_Name("avx2", "AVX2"),
+	PRM_Name(0)
+};
+static PRM_ChoiceList kernelMenu(PRM_CHOICELIST_SINGLE, kernelMenuNames);
+
+static PRM_Name motionBlur("motion_blur", "Motion Blur");
+static PRM_Name shutterSamples("shutter_samples", "Shutter Samples");
+static PRM_Name shutter("shutter", "Shutter");
+static PRM_Name addVelocity("add_velocity", "Add Velocity Attribute");
+static PRM_Name addSampleP("add_sample_p", "Add Sample Positions");
+static PRM_Default shutterSamplesDefault(3);
+static PRM_Default shutterDefault(0.5);
+static PRM_Range shutterSamplesRange(PRM_RANGE_RESTRICTED, 2, PRM_RANGE_UI, 8);
+static PRM_Range shutterRange(PRM_RANGE_RESTRICTED, 0, PRM_RANGE_UI, 1);
+
+static PRM_Name copyChanged("copy_changed", "Copy Only Changed Attributes");
+static PRM_Name addTimings("add_timings", "Add Cook Timings Attribute");
+
 static PRM_Range stretchRange(PRM_RANGE_RESTRICTED, -1, PRM_RANGE_UI, 2);
 
 PRM_Template
 PathDeform::parmsTemplatesList[] =
 {
 	PRM_Template(PRM_ORD, 1, &PRMaxisName, PRMtwoDefaults, &PRMaxisMenu),
+	PRM_Template(PRM_ORD, 1, &deformMode, PRMzeroDefaults, &deformModeMenu),
+	PRM_Template(PRM_TOGGLE_E, 1, &multiCurve, PRMzeroDefaults),
+	PRM_Template(PRM_STRING, 1, &pieceAttrib, &pieceAttribDefault),
+	PRM_Template(PRM_ORD, 1, &frameMode, PRMzeroDefaults, &frameModeMenu),
 	PRM_Template(PRM_TOGGLE_E, 1, &useUpVector, PRMzeroDefaults),
 	PRM_Template(PRM_XYZ, 3, &PRMupVectorName, PRMyaxisDefaults),
+	PRM_Template(PRM_ORD, 1, &interpolation, PRMzeroDefaults, &interpolationMenu),
+	PRM_Template(PRM_FLT_J, 1, &curveTolerance, &curveToleranceDefault, 0, &curveToleranceRange),
 	PRM_Template(PRM_TOGGLE_E, 1, &useCurveTwist, PRMoneDefaults),
 	PRM_Template(PRM_TOGGLE_E, 1, &useCurveWidth, PRMoneDefaults),
 	PRM_Template(PRM_TOGGLE_E, 1, &recompute_normals, PRMzeroDefaults),
+	PRM_Template(PRM_ORD, 1, &normalMode, PRMoneDefaults, &normalModeMenu),
 	PRM_Template(PRM_TOGGLE_E, 1, &addBasisAttr, PRMzeroDefaults),
 	PRM_Template(PRM_TOGGLE_E, 1, &deformVattribs, PRMzeroDefaults),
     PRM_Template(PRM_STRING, 1, &vecAttribs, 0),
@@ -75,6 +177,14 @@ PathDeform::parmsTemplatesList[] =
     PRM_Template(PRM_FLT_J, 1, &stretch, PRMzeroDefaults, 0, &stretchRange),
 	PRM_Template(PRM_FLT_J, 1, &PRMoffsetName, PRMzeroDefaults),
 	PRM_Template(PRM_FLT_J, 1, &PRMrollName, PRMzeroDefaults),
+	PRM_Template(PRM_TOGGLE_E, 1, &motionBlur, PRMzeroDefaults),
+	PRM_Template(PRM_INT_J, 1, &shutterSamples, &shutterSamplesDefault, 0, &shutterSamplesRange),
+	PRM_Template(PRM_FLT_J, 1, &shutter, &shutterDefault, 0, &shutterRange),
+	PRM_Template(PRM_TOGGLE_E, 1, &addVelocity, PRMoneDefaults),
+	PRM_Template(PRM_TOGGLE_E, 1, &addSampleP, PRMzeroDefaults),
+	PRM_Template(PRM_ORD, 1, &kernelName, PRMzeroDefaults, &kernelMenu),
+	PRM_Template(PRM_TOGGLE_E, 1, &copyChanged, PRMoneDefaults),
+	PRM_Template(PRM_TOGGLE_E, 1, &addTimings, PRMzeroDefaults),
 	PRM_Template(),
 };
 
@@ -86,376 +196,1537 @@ PathDeform::updateParmsFlags()
 	changes |= setVisibleState(PRMupVectorName.getToken(), PARM_USEUPVECTOR());
     changes |= enableParm(stretch.getToken(), !PARM_STRETCH_TOLEN());
     changes |= enableParm(vecAttribs.getToken(), PARM_DEFORM_VECTORS());
+    changes |= enableParm(pieceAttrib.getToken(), PARM_MULTI_CURVE());
+    changes |= enableParm(normalMode.getToken(), PARM_COMPUTE_N());
+    changes |= enableParm(shutterSamples.getToken(), PARM_MOTION_BLUR());
+    changes |= enableParm(shutter.getToken(), PARM_MOTION_BLUR());
+    changes |= enableParm(addVelocity.getToken(), PARM_MOTION_BLUR());
+    changes |= enableParm(addSampleP.getToken(), PARM_MOTION_BLUR());
 	return changes;
 }
 
 
+SOP_PathDeformParms::SOP_PathDeformParms()
+	: axis(2), multi_curve(0), deform_mode(DEFORM_POINTS), piece_attrib("class"), frame_mode(0), use_up_vector(0),
+	  up_vector(0, 1, 0), interpolation(0), curve_tolerance(0.001), use_curve_twist(1), use_curve_width(1),
+	  recompute_n(0), normal_mode(NORMALS_RECOMPUTE), add_basis_attribs(0), deform_vattribs(0),
+	  stretch_to_len(0), stretch(0), offset(0), roll(0), motion_blur(0), shutter_samples(3),
+	  shutter(0.5), add_velocity(1), add_sample_p(0), kernel(0), add_timings(0), copy_changed(1),
+	  cook_time(0),
+	  shutter_time(0)
+{
+}
+
 void
-PathDeform::computeBboxAxis(const int &axis, UT_Vector3 &pt0, UT_Vector3 &pt1)
+SOP_PathDeformParms::loadFromOpSubclass(const LoadParms &loadparms)
 {
-	float x,y;
-	switch (axis)
+	const OP_Node *node = loadparms.node();
+	DEP_MicroNode *depnode = loadparms.depnode();
+	fpreal time = loadparms.context().getTime();
+
+	OP_Utils::evalOpParm(axis, node, "axis", time, depnode);
+	OP_Utils::evalOpParm(multi_curve, node, "multi_curve", time, depnode);
+	OP_Utils::evalOpParm(deform_mode, node, "deform_mode", time, depnode);
+	OP_Utils::evalOpParm(piece_attrib, node, "piece_attrib", time, depnode);
+	OP_Utils::evalOpParm(frame_mode, node, "frame_mode", time, depnode);
+	OP_Utils::evalOpParm(use_up_vector, node, "use_up_vector", time, depnode);
+	OP_Utils::evalOpParm(up_vector, node, "upvector", time, depnode);
+	OP_Utils::evalOpParm(interpolation, node, "interpolation", time, depnode);
+	OP_Utils::evalOpParm(curve_tolerance, node, "curve_tolerance", time, depnode);
+	OP_Utils::evalOpParm(use_curve_twist, node, "use_curve_twist", time, depnode);
+	OP_Utils::evalOpParm(use_curve_width, node, "use_curve_width", time, depnode);
+	OP_Utils::evalOpParm(recompute_n, node, "recompute_n", time, depnode);
+	OP_Utils::evalOpParm(normal_mode, node, "normal_mode", time, depnode);
+	OP_Utils::evalOpParm(add_basis_attribs, node, "add_basis_attribs", time, depnode);
+	OP_Utils::evalOpParm(deform_vattribs, node, "deform_vattribs", time, depnode);
+	OP_Utils::evalOpParm(vattribs, node, "vattribs", time, depnode);
+	OP_Utils::evalOpParm(stretch_to_len, node, "stretch_to_len", time, depnode);
+	OP_Utils::evalOpParm(stretch, node, "stretch", time, depnode);
+	OP_Utils::evalOpParm(offset, node, "offset", time, depnode);
+	OP_Utils::evalOpParm(roll, node, "roll", time, depnode);
+	OP_Utils::evalOpParm(motion_blur, node, "motion_blur", time, depnode);
+	OP_Utils::evalOpParm(shutter_samples, node, "shutter_samples", time, depnode);
+	OP_Utils::evalOpParm(shutter, node, "shutter", time, depnode);
+	OP_Utils::evalOpParm(add_velocity, node, "add_velocity", time, depnode);
+	OP_Utils::evalOpParm(add_sample_p, node, "add_sample_p", time, depnode);
+	OP_Utils::evalOpParm(kernel, node, "kernel", time, depnode);
+	OP_Utils::evalOpParm(add_timings, node, "add_timings", time, depnode);
+	OP_Utils::evalOpParm(copy_changed, node, "copy_changed", time, depnode);
+	cook_time = time;
+
+	// Offset, stretch and roll at every shutter sample, the first one is
+	// the cook time itself
+	shutter_time = shutter * OPgetDirector()->getChannelManager()->getSecsPerSample();
+	sample_offset.clear();
+	sample_stretch.clear();
+	sample_roll.clear();
+	if (!motion_blur)
+		return;
+	const int num_samples = SYSmax(shutter_samples, exint(2));
+	for (int sample = 0; sample < num_samples; ++sample)
 	{
-	case 0:
-		x = bbox_min[2] + bbox_max[2];
-		y = bbox_min[1] + bbox_max[1];
-		pt0.assign(bbox_min[axis], x, y);
-		pt1.assign(bbox_max[axis], x, y);
-		break;
-	case 1:
-		x = bbox_min[0] + bbox_max[0];
-		y = bbox_min[2] + bbox_max[2];
-		pt0.assign(x, bbox_min[axis], y);
-		pt1.assign(x, bbox_max[axis], y);
-		break;
-	case 2:
-		x = bbox_min[0] + bbox_max[0];
-		y = bbox_min[1] + bbox_max[1];
-		pt0.assign(x, y, bbox_min[axis]);
-		pt1.assign(x, y, bbox_max[axis]);
-		break;
+		fpreal sample_time = time + shutter_time * sample / (num_samples - 1);
+		fpreal64 value;
+		OP_Utils::evalOpParm(value, node, "offset", sample_time, depnode);
+		sample_offset.append(value);
+		OP_Utils::evalOpParm(value, node, "stretch", sample_time, depnode);
+		sample_stretch.append(value);
+		OP_Utils::evalOpParm(value, node, "roll", sample_time, depnode);
+		sample_roll.append(value);
 	}
 }
 
+void
+SOP_PathDeformParms::copyFrom(const SOP_NodeParms *src)
+{
+	*this = *static_cast<const SOP_PathDeformParms *>(src);
+}
+
+const SOP_NodeVerb::Register<SOP_PathDeformVerb> SOP_PathDeformVerb::theVerb;
+
+OP_ERROR
+PathDeform::cookMySop(OP_Context &context)
+{
+	// The node only holds the parameters, the verb does the work
+	return cookMyselfAsVerb(context);
+}
+
+void
+PathDeform::getNodeSpecificInfoText(OP_Context &context, OP_NodeInfoParms &iparms)
+{
+	SOP_Node::getNodeSpecificInfoText(context, iparms);
+
+	// Timings of the last cook, kept by the verb in the node cache
+	const SOP_PathDeformCache *cache = static_cast<const SOP_PathDeformCache *>(myNodeVerbCache);
+	if (!cache || cache->timings.total_seconds <= 0.0)
+		return;
+	UT_WorkBuffer buf;
+	cache->timings.formatInfo(buf);
+	iparms.append(buf.buffer());
+}
+
+static const char *stageNames[NUM_STAGES] =
+{
+	"copy", "curves", "pieces", "bounds", "projection", "deform", "motion_blur", "normals"
+};
 
 void
-PathDeform::computeCurveAttributes(const GEO_Curve *curve_prim, fpreal time)
+CookTimings::clear()
 {
-	int use_curve_twist = PARM_USETWIST();
-	float roll_parm = PARM_ROLL(time);
-	UT_Vector3 prevP, curP, nextP, tang, btang, up, avg_normal;
-	float roll_angle;
+	for (int i = 0; i < NUM_STAGES; ++i)
+		stage_seconds[i] = 0.0;
+	total_seconds = 0.0;
+	num_points = 0;
+	num_threads = 0;
+	time = 0.0;
+}
 
-	if (PARM_USEUPVECTOR())
-		avg_normal.assign(PARM_UPX(time), PARM_UPY(time), PARM_UPZ(time));
-	else
-        avg_normal = curve_prim->computeNormal();
+double
+CookTimings::pointsPerSecond() const
+{
+	return total_seconds > 0.0 ? num_points / total_seconds : 0.0;
+}
+
+void
+CookTimings::formatJSON(const char *node_path, UT_WorkBuffer &buf) const
+{
+	// One object per cook, stage times in seconds and percent of the total
+	double other = total_seconds;
+	buf.sprintf("{\"node\": \"%s\", \"time\": %g, \"points\": %lld, \"threads\": %d, "
+			"\"seconds\": %g, \"points_per_sec\": %g, \"stages\": {",
+			node_path ? node_path : "", time, (long long)num_points, num_threads,
+			total_seconds, pointsPerSecond());
+	for (int i = 0; i < NUM_STAGES; ++i)
+	{
+		other -= stage_seconds[i];
+		buf.appendSprintf("\"%s\": {\"seconds\": %g, \"percent\": %.2f}, ", stageNames[i],
+				stage_seconds[i], total_seconds > 0.0 ? 100.0 * stage_seconds[i] / total_seconds : 0.0);
+	}
+	other = SYSmax(other, 0.0);
+	buf.appendSprintf("\"other\": {\"seconds\": %g, \"percent\": %.2f}}}",
+			other, total_seconds > 0.0 ? 100.0 * other / total_seconds : 0.0);
+}
+
+void
+CookTimings::formatInfo(UT_WorkBuffer &buf) const
+{
+	buf.sprintf("Last cook: %.2f ms, %lld points, %.2f M points/s on %d threads\n",
+			total_seconds * 1000.0, (long long)num_points, pointsPerSecond() * 1e-6, num_threads);
+	double other = total_seconds;
+	for (int i = 0; i < NUM_STAGES; ++i)
+	{
+		other -= stage_seconds[i];
+		buf.appendSprintf("    %-12s %8.2f ms %6.1f%%\n", stageNames[i], stage_seconds[i] * 1000.0,
+				total_seconds > 0.0 ? 100.0 * stage_seconds[i] / total_seconds : 0.0);
+	}
+	other = SYSmax(other, 0.0);
+	buf.appendSprintf("    %-12s %8.2f ms %6.1f%%\n", "other", other * 1000.0,
+			total_seconds > 0.0 ? 100.0 * other / total_seconds : 0.0);
+}
+
+
+static void
+computeBboxAxis(const UT_BoundingBox &bbox, const int &axis, UT_Vector3 &pt0, UT_Vector3 &pt1)
+{
+	// Object axis through the bbox center, from the min to the max side.
+	// Pieces are far from the origin in multi curve mode, so this has to be
+	// the actual center of each box.
+	pt0 = bbox.center();
+	pt1 = pt0;
+	pt0[axis] = bbox.minvec()[axis];
+	pt1[axis] = bbox.maxvec()[axis];
+}
+
+
+// Data ID of every group, the output is copied again when one changes.
+static void
+appendGroupIds(const GA_ElementGroupTable &groups, UT_Array<fpreal64> &key)
+{
+	key.append(groups.entries());
+	for (GA_ElementGroupTable::iterator it = groups.beginTraverse(); !it.atEnd(); ++it)
+		key.append(it.group()->getDataId());
+}
+
+static const GA_AttributeOwner copyOwners[] =
+{
+	GA_ATTRIB_VERTEX, GA_ATTRIB_POINT, GA_ATTRIB_PRIMITIVE, GA_ATTRIB_DETAIL
+};
+
+void
+SOP_PathDeformVerb::copyInput(bool copy_changed, const GU_Detail *input_gdp, GU_Detail *gdp,
+		OutputCopyCache &copy_cache)
+{
+	// The output still holds the last cook when its detail and topology are
+	// the ones recorded then, and the input has the same topology and groups
+	UT_Array<fpreal64> topology_key;
+	topology_key.append(input_gdp->getUniqueId());
+	topology_key.append(input_gdp->getTopology().getDataId());
+	topology_key.append(input_gdp->getPrimitiveList().getDataId());
+	topology_key.append(input_gdp->getNumVertexOffsets());
+	topology_key.append(input_gdp->getNumPointOffsets());
+	topology_key.append(input_gdp->getNumPrimitiveOffsets());
+	appendGroupIds(input_gdp->pointGroups(), topology_key);
+	appendGroupIds(input_gdp->primitiveGroups(), topology_key);
+	appendGroupIds(input_gdp->vertexGroups(), topology_key);
+	topology_key.append(input_gdp->edgeGroups().entries());
+	topology_key.append(gdp->getUniqueId());
+	topology_key.append(gdp->getTopology().getDataId());
+	topology_key.append(gdp->getPrimitiveList().getDataId());
+
+	bool reuse = copy_changed && topology_key == copy_cache.topology_key;
+
+	// Attributes of the input, in the order of the record
+	UT_Array<InputAttribRecord> attribs;
+	for (int o = 0; o < 4; ++o)
+	{
+		const GA_AttributeDict &dict = input_gdp->getAttributeDict(copyOwners[o]);
+		for (GA_AttributeDict::iterator it = dict.begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it)
+		{
+			InputAttribRecord record;
+			record.owner = copyOwners[o];
+			record.name = it.attrib()->getName();
+			record.data_id = it.attrib()->getDataId();
+			attribs.append(record);
+		}
+	}
+	if (reuse && attribs.entries() != copy_cache.attribs.entries())
+		reuse = false;
+	for (exint i = 0; reuse && i < attribs.entries(); ++i)
+	{
+		const InputAttribRecord &record = copy_cache.attribs(i);
+		if (record.owner != attribs(i).owner || record.name != attribs(i).name)
+			reuse = false;
+	}
+
+	if (reuse)
+	{
+		// Attributes created by the last cook go away, they are added again
+		// if still wanted
+		for (int o = 0; o < 4; ++o)
+		{
+			UT_StringArray created;
+			const GA_AttributeDict &dict = gdp->getAttributeDict(copyOwners[o]);
+			for (GA_AttributeDict::iterator it = dict.begin(GA_SCOPE_PUBLIC); !it.atEnd(); ++it)
+			{
+				if (!input_gdp->findAttribute(copyOwners[o], it.attrib()->getName()))
+					created.append(it.attrib()->getName());
+			}
+			for (exint i = 0; i < created.entries(); ++i)
+				gdp->destroyAttribute(copyOwners[o], created(i));
+		}
+
+		// Only what changed upstream or what the deform wrote is copied
+		// again. Numeric attributes are replaced by referencing the input
+		// pages copy-on-write, the detached pages of the last cook are
+		// released
+		for (exint i = 0; reuse && i < attribs.entries(); ++i)
+		{
+			const InputAttribRecord &record = attribs(i);
+			const bool written = copy_cache.written_attribs.find(record.name) >= 0;
+			if (!written && record.data_id == copy_cache.attribs(i).data_id)
+				continue;
+			const GA_Attribute *src = input_gdp->findAttribute(record.owner, record.name);
+			GA_Attribute *dst = gdp->findAttribute(record.owner, record.name);
+			if (!dst || !dst->replace(*src))
+				reuse = false;
+			else
+				dst->bumpDataId();
+		}
+	}
+
+	// A full copy shares the numeric attribute pages with the input the same
+	// way, only the pages the deform writes are detached from it
+	if (!reuse)
+	{
+		gdp->replaceWith(*input_gdp);
+		gdp->bumpAllDataIds();
+	}
 
-	avg_normal.normalize();
-	short int npts = curve_prim->getPointRange().getEntries();
-	for(GA_Iterator it(curve_prim->getPointRange()); !it.atEnd(); it.advance())
+	copy_cache.attribs = attribs;
+	copy_cache.written_attribs.clear();
+	copy_cache.topology_key = topology_key;
+	copy_cache.topology_key(copy_cache.topology_key.entries() - 3) = gdp->getUniqueId();
+	copy_cache.topology_key(copy_cache.topology_key.entries() - 2) = gdp->getTopology().getDataId();
+	copy_cache.topology_key(copy_cache.topology_key.entries() - 1) = gdp->getPrimitiveList().getDataId();
+}
+
+void
+SOP_PathDeformVerb::packCurveSamples(const GEO_Face *curve_prim, exint curve,
+		const GA_ROHandleV3 &hndl_curve_p, const GA_ROHandleF &hndl_curve_twist,
+		const GA_ROHandleF &hndl_curve_width, pathdeform::CurveCache &curve_cache)
+{
+	// Copy the curve samples out of the GA attributes once, in vertex
+	// order, together with the cumulative arc length so the deformer can
+	// map a distance along the path to a segment. Closed curves end with
+	// their first point again, for the closing segment.
+	const unsigned int start = curve_cache.curveStart(curve);
+	const unsigned int npts = curve_cache.curveEntries(curve);
+	const unsigned int nvtx = curve_prim->getVertexCount();
+	for (unsigned int j = 0; j < npts; ++j)
 	{
-		roll_angle = 0.0;
-		GA_Offset ptof = it.getOffset();
-        curP = hndl_curve_p.get(ptof);
-        if (ptof == curve_prim->getPointOffset(0)) // first point
-        {
-			nextP = hndl_curve_p.get(ptof + 1);
-        	tang = curP - nextP;
+		const unsigned int i = start + j;
+		GA_Offset ptof = curve_prim->getPointOffset(j % nvtx);
+		UT_Vector3 curP = hndl_curve_p.get(ptof);
+		for (int c = 0; c < 3; ++c)
+			curve_cache.P[c][i] = curP[c];
+		curve_cache.width[i] = hndl_curve_width.isValid() ? hndl_curve_width.get(ptof) : 1.0;
+		curve_cache.twist[i] = hndl_curve_twist.isValid() ? hndl_curve_twist.get(ptof) : 0.0;
+	}
+	pathdeform::computeArcLength(curve_cache, curve);
+}
 
+// NURBS and Bezier curves, evaluated through their basis. Polys are packed
+// from their points.
+static bool
+isSplineCurve(const GEO_Face *curve_prim)
+{
+	return curve_prim->getTypeId() == GA_PRIMNURBCURVE || curve_prim->getTypeId() == GA_PRIMBEZCURVE;
+}
+
+void
+SOP_PathDeformVerb::bakeSplineSamples(const GEO_Face *curve_prim, fpreal tolerance,
+		SplineSamples &samples)
+{
+	// Tolerance relative to the curve size. Spans start one per control
+	// point and are refined where the curve bends.
+	UT_BoundingBox bbox;
+	curve_prim->getBBox(&bbox);
+	const float abs_tolerance = SYSmax(tolerance * bbox.sizeMax(), 1e-6);
+	const unsigned int nvtx = curve_prim->getVertexCount();
+	const unsigned int num_spans = curve_prim->isClosed() ? nvtx : SYSmax(nvtx, 2u) - 1;
+	samples.P.clear();
+	samples.T.clear();
+	samples.u.clear();
+	pathdeform::bakeCurveSamples([&](float u, float P[3], float D[3])
+	{
+		UT_Vector4 pos, der;
+		curve_prim->evaluatePoint(pos, u, 0, 0, 0);
+		curve_prim->evaluatePoint(der, u, 0, 1, 0);
+		for (int c = 0; c < 3; ++c)
+		{
+			P[c] = pos[c];
+			D[c] = der[c];
 		}
-		else if(ptof == curve_prim->getPointOffset(npts - 1)) // last point
+	}, num_spans, abs_tolerance, SYSdegToRad(3.0f), 10, samples.P, samples.T, samples.u);
+}
+
+void
+SOP_PathDeformVerb::packSplineSamples(const GEO_Face *curve_prim, exint curve,
+		const SplineSamples &samples, const GA_ROHandleF &hndl_curve_twist,
+		const GA_ROHandleF &hndl_curve_width, pathdeform::CurveCache &curve_cache)
+{
+	// Baked positions and tangents. Tangents point back along the curve like
+	// the ones of polys. Width and twist are blended between the control
+	// points around the sample parameter.
+	const unsigned int start = curve_cache.curveStart(curve);
+	const unsigned int npts = curve_cache.curveEntries(curve);
+	const unsigned int nvtx = curve_prim->getVertexCount();
+	const bool closed = curve_prim->isClosed();
+	for (unsigned int j = 0; j < npts; ++j)
+	{
+		const unsigned int i = start + j;
+		for (int c = 0; c < 3; ++c)
 		{
-			nextP = hndl_curve_p.get(ptof - 1);
-			tang = nextP - curP;
+			curve_cache.P[c][i] = samples.P[3 * j + c];
+			curve_cache.T[c][i] = -samples.T[3 * j + c];
 		}
-		else
+
+		const float x = samples.u[j] * (closed ? nvtx : nvtx - 1);
+		unsigned int v0 = SYSmin(unsigned(x), closed ? nvtx : nvtx - 1);
+		const float f = x - v0;
+		unsigned int v1 = closed ? (v0 + 1) % nvtx : SYSmin(v0 + 1, nvtx - 1);
+		v0 %= nvtx;
+		GA_Offset pt0 = curve_prim->getPointOffset(v0);
+		GA_Offset pt1 = curve_prim->getPointOffset(v1);
+		curve_cache.width[i] = hndl_curve_width.isValid() ?
+				SYSlerp(hndl_curve_width.get(pt0), hndl_curve_width.get(pt1), f) : 1.0;
+		curve_cache.twist[i] = hndl_curve_twist.isValid() ?
+				SYSlerp(hndl_curve_twist.get(pt0), hndl_curve_twist.get(pt1), f) : 0.0;
+	}
+	curve_cache.setCurveTangents(curve, true);
+	pathdeform::computeArcLength(curve_cache, curve);
+}
+
+void
+SOP_PathDeformVerb::computeCurveFrames(const GEO_Face *curve_prim, exint curve,
+		const CurveFrameParms &frame_parms, pathdeform::CurveCache &curve_cache)
+{
+	// Frames from the packed samples, written straight into the cache.
+	UT_Vector3 avg_normal;
+
+	if (frame_parms.use_up_vector)
+		avg_normal = frame_parms.up_vector;
+	else
+        avg_normal = curve_prim->computeNormal();
+
+	pathdeform::computeCurveFrames(curve_cache, curve, frame_parms.frame_mode,
+			frame_parms.use_twist, avg_normal.data(), UTParallelForAdapter());
+}
+
+bool
+SOP_PathDeformVerb::mapPiecesToCurves(const CookParms &cookparms, const GU_Detail *gdp,
+		const GU_Detail *curve_gdp, const UT_StringHolder &piece_name, exint num_curves,
+		UT_Array<int> &point_curve)
+{
+	// Every point gets the curve of its piece, or -1 to stay undeformed.
+	// Piece values select curves by primitive number, or by the value of a
+	// primitive attribute with the same name on the curves. A curveid point
+	// or primitive attribute takes precedence and is always a primitive
+	// number. Pieces following the same curve share one bounding box, so
+	// instances are stacked in place and spread with pathoffset.
+	GA_ROHandleI hndl_piece(gdp->findIntTuple(GA_ATTRIB_POINT, "curveid", 1));
+	GA_ROHandleI hndl_prim_piece(gdp->findIntTuple(GA_ATTRIB_PRIMITIVE, "curveid", 1));
+	const bool use_curveid = hndl_piece.isValid() || hndl_prim_piece.isValid();
+	if (!use_curveid)
+	{
+		hndl_piece.bind(gdp->findIntTuple(GA_ATTRIB_POINT, piece_name, 1));
+		hndl_prim_piece.bind(gdp->findIntTuple(GA_ATTRIB_PRIMITIVE, piece_name, 1));
+	}
+	if (!hndl_piece.isValid() && !hndl_prim_piece.isValid())
+	{
+		cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, piece_name.c_str());
+		return false;
+	}
+
+	UT_Map<int, int> curve_from_value;
+	GA_ROHandleI hndl_curve_piece;
+	if (!use_curveid)
+		hndl_curve_piece.bind(curve_gdp->findIntTuple(GA_ATTRIB_PRIMITIVE, piece_name, 1));
+	if (hndl_curve_piece.isValid())
+	{
+		for (exint i = num_curves - 1; i >= 0; --i)
+			curve_from_value[hndl_curve_piece.get(curve_gdp->primitiveOffset(i))] = i;
+	}
+
+	point_curve.setSize(gdp->getNumPointOffsets());
+	point_curve.constant(-1);
+	UTparallelFor(GA_SplittableRange(gdp->getPointRange()), [&](const GA_SplittableRange &r)
+	{
+		for (GA_Iterator it(r); !it.atEnd(); ++it)
 		{
-			prevP = hndl_curve_p.get(ptof - 1);
-			nextP = hndl_curve_p.get(ptof + 1);
-        	tang = prevP - nextP;
+			GA_Offset ptof = *it;
+			int piece;
+			if (hndl_piece.isValid())
+				piece = hndl_piece.get(ptof);
+			else
+			{
+				GA_Offset vtxof = gdp->pointVertex(ptof);
+				if (!GAisValid(vtxof))
+					continue;
+				piece = hndl_prim_piece.get(gdp->vertexPrimitive(vtxof));
+			}
+
+			if (hndl_curve_piece.isValid())
+			{
+				UT_Map<int, int>::const_iterator found = curve_from_value.find(piece);
+				if (found != curve_from_value.end())
+					point_curve(ptof) = found->second;
+			}
+			else if (piece >= 0 && piece < num_curves)
+				point_curve(ptof) = piece;
 		}
-        tang.normalize();
-        btang = cross(tang, avg_normal);
-        btang.normalize();
-		up = cross(btang, tang);
+	});
+	return true;
+}
 
-		if (use_curve_twist || roll_parm > 0.0)
+// Data ID of an optional attribute for the cache keys, -1 if it doesn't exist.
+static fpreal64
+attribDataId(const GA_Attribute *attr)
+{
+	return attr ? attr->getDataId() : -1;
+}
+
+// Bounding box of the points assigned to every curve.
+class ComputePieceBounds
+{
+public:
+	ComputePieceBounds(const GA_Attribute *attr_geo_p, const int *point_curve, exint num_curves)
+		: attr_geo_p(attr_geo_p), point_curve(point_curve)
+	{
+		bounds.setSize(num_curves);
+		for (exint i = 0; i < num_curves; ++i)
+			bounds(i).initBounds();
+	}
+
+	ComputePieceBounds(const ComputePieceBounds &src, UT_Split)
+		: attr_geo_p(src.attr_geo_p), point_curve(src.point_curve)
+	{
+		bounds.setSize(src.bounds.entries());
+		for (exint i = 0; i < bounds.entries(); ++i)
+			bounds(i).initBounds();
+	}
+
+	void operator()(const GA_SplittableRange &r)
+	{
+		GA_ROPageHandleV3 hndl_geo_p(attr_geo_p);
+		GA_Offset start, end;
+		for (GA_Iterator it(r); it.blockAdvance(start, end);)
 		{
-			if (use_curve_twist && hndl_curve_twist.isValid())
-				roll_angle = hndl_curve_twist.get(ptof);
-			if (roll_parm > 0.0)
-				roll_angle += roll_parm * 360.0;
-            UT_QuaternionD quat(SYSdegToRad(roll_angle), tang);
-			btang = quat.rotate(btang);
-			up = quat.rotate(up);
+			hndl_geo_p.setPage(start);
+			for (GA_Offset ptof = start; ptof < end; ++ptof)
+			{
+				int curve = point_curve ? point_curve[ptof] : 0;
+				if (curve >= 0)
+					bounds(curve).enlargeBounds(hndl_geo_p.get(ptof));
+			}
 		}
+	}
+
+	void join(const ComputePieceBounds &other)
+	{
+		for (exint i = 0; i < bounds.entries(); ++i)
+			bounds(i).enlargeBounds(other.bounds(i));
+	}
+
+	UT_Array<UT_BoundingBox> bounds;
+
+private:
+	const GA_Attribute *attr_geo_p;
+	const int *point_curve;
+};
+
+// Parallel reduction over P, min/max joins give the same box whatever the
+// split. Without pieces every point goes to the first box, this replaces
+// the serial GU_Detail::getBBox pass.
+void
+SOP_PathDeformVerb::computePieceBounds(const GU_Detail *gdp, int multi_curve, exint num_curves,
+		PointProjectionCache &point_cache)
+{
+	const int *point_curve = multi_curve ? point_cache.point_curve.array() : nullptr;
+	ComputePieceBounds piece_bounds_op(gdp->getP(), point_curve, multi_curve ? num_curves : 1);
+	UTparallelReduce(GA_SplittableRange(gdp->getPointRange()), piece_bounds_op);
+	point_cache.piece_bounds = piece_bounds_op.bounds;
+}
 
-		hndl_curve_tang.set(ptof, tang);
-		hndl_curve_btang.set(ptof, btang);
-		hndl_curve_up.set(ptof, up);
+void
+SOP_PathDeformVerb::computePointProjection(const GU_Detail *gdp, int axis, int multi_curve,
+		exint num_curves, PointProjectionCache &point_cache)
+{
+	const GA_Attribute *attr_geo_p = gdp->getP();
+	const int *point_curve = multi_curve ? point_cache.point_curve.array() : nullptr;
+
+	// Object axis of every piece
+	point_cache.project_parms.setSize(num_curves);
+	for (exint i = 0; i < num_curves; ++i)
+	{
+		const UT_BoundingBox &bbox = point_cache.piece_bounds(i);
+		pathdeform::ProjectParms &parms = point_cache.project_parms(i);
+		parms.axis = axis;
+		if (!bbox.isValid())
+			continue;
+		UT_Vector3 axis_pt0, axis_pt1;
+		computeBboxAxis(bbox, axis, axis_pt0, axis_pt1);
+		for (int c = 0; c < 3; ++c)
+			parms.center[c] = axis_pt0[c];
+		parms.axis_min = bbox.minvec()[axis];
+		parms.axis_size = bbox.sizeAxis(axis);
+	}
+
+	// Project every point
+	const exint num_offsets = gdp->getNumPointOffsets();
+	point_cache.relpos.setSize(num_offsets);
+	point_cache.cu.setSize(num_offsets);
+	point_cache.cb.setSize(num_offsets);
+	const pathdeform::ProjectParms *project_parms = point_cache.project_parms.array();
+	float *relpos = point_cache.relpos.array();
+	float *cu = point_cache.cu.array();
+	float *cb = point_cache.cb.array();
+	UTparallelFor(GA_SplittableRange(gdp->getPointRange()), [&](const GA_SplittableRange &r)
+	{
+		GA_ROPageHandleV3 hndl_geo_p(attr_geo_p);
+		GA_Offset start, end;
+		for (GA_Iterator it(r); it.blockAdvance(start, end);)
+		{
+			hndl_geo_p.setPage(start);
+			GA_Offset run_start = start;
+			while (run_start < end)
+			{
+				int curve = point_curve ? point_curve[run_start] : 0;
+				GA_Offset run_end = run_start + 1;
+				while (point_curve && run_end < end && point_curve[run_end] == curve)
+					++run_end;
+				if (!point_curve)
+					run_end = end;
+				if (curve >= 0)
+					pathdeform::projectPoints(project_parms[curve],
+							hndl_geo_p.value(run_start).data(), run_end - run_start,
+							relpos + run_start, cu + run_start, cb + run_start);
+				run_start = run_end;
+			}
+		}
+	});
+}
 
+void
+SOP_PathDeformVerb::findPointOverrides(const SOP_PathDeformParms &parms, const GU_Detail *gdp,
+		PointOverrideAttribs &overrides)
+{
+	// Point attributes win over primitive ones. Stretch to length ignores
+	// pathstretch like it does the stretch parameter.
+	static const char *names[NUM_OVERRIDES] = {"pathoffset", "pathstretch", "pathroll"};
+	const GA_Attribute *prim_attribs[NUM_OVERRIDES];
+	bool any_prim = false;
+	for (int k = 0; k < NUM_OVERRIDES; ++k)
+	{
+		overrides.point_attribs[k] = nullptr;
+		prim_attribs[k] = nullptr;
+		overrides.prim_values[k].clear();
+		if (k == OVERRIDE_STRETCH && parms.stretch_to_len)
+			continue;
+		overrides.point_attribs[k] = gdp->findFloatTuple(GA_ATTRIB_POINT, names[k], 1);
+		if (!overrides.point_attribs[k])
+			prim_attribs[k] = gdp->findFloatTuple(GA_ATTRIB_PRIMITIVE, names[k], 1);
+		if (prim_attribs[k])
+		{
+			overrides.prim_values[k].setSize(gdp->getNumPointOffsets());
+			any_prim = true;
+		}
 	}
+	if (!any_prim)
+		return;
+
+	// Primitive values promoted to the points, from the primitive of their
+	// first vertex
+	UTparallelFor(GA_SplittableRange(gdp->getPointRange()), [&](const GA_SplittableRange &r)
+	{
+		GA_ROHandleF hndl_prim[NUM_OVERRIDES];
+		for (int k = 0; k < NUM_OVERRIDES; ++k)
+			hndl_prim[k].bind(prim_attribs[k]);
+		for (GA_Iterator it(r); !it.atEnd(); ++it)
+		{
+			GA_Offset ptof = *it;
+			GA_Offset vtxof = gdp->pointVertex(ptof);
+			GA_Offset primof = GAisValid(vtxof) ? gdp->vertexPrimitive(vtxof) : GA_INVALID_OFFSET;
+			for (int k = 0; k < NUM_OVERRIDES; ++k)
+			{
+				if (hndl_prim[k].isValid())
+					overrides.prim_values[k](ptof) = GAisValid(primof) ? hndl_prim[k].get(primof) : 0.0f;
+			}
+		}
+	});
 }
 
-inline float
-pointRelativeToBbox(const UT_Vector3 &pt, const int &axis, const UT_Vector3 &bbox_min, const UT_Vector3 &bbox_max)
+void
+SOP_PathDeformVerb::computeDeformParms(const SOP_PathDeformParms &parms, fpreal64 offset,
+		fpreal64 stretch, fpreal64 roll, const SOP_PathDeformCache &cache, exint num_curves,
+		UT_Array<pathdeform::DeformParms> &deform_parms)
 {
-	return SYSfit(pt[axis], bbox_min[axis], bbox_max[axis], 0, 1);
+	// Only offset, stretch and roll are animated, everything else the
+	// kernel reads comes from the caches
+	const PointProjectionCache &point_cache = cache.point_cache;
+	int axis = parms.axis;
+	int use_width = parms.use_curve_width;
+	int interp = parms.interpolation;
+    int stretch_tolen = parms.stretch_to_len;
+    float stretch_parm = stretch;
+	const float roll_rad = SYSdegToRad(roll * 360.0);
+
+	deform_parms.setSize(num_curves);
+	for (exint i = 0; i < num_curves; ++i)
+	{
+		const UT_BoundingBox &bbox = point_cache.piece_bounds(i);
+		if (!bbox.isValid())
+			continue;
+		float arclen = cache.curve_cache.curveLength(i);
+
+	    float stretch_mult;
+		float object_axis_size = bbox.sizeAxis(axis);
+	    if (stretch_tolen)
+	        stretch_mult = arclen / object_axis_size;
+	    else
+	        stretch_mult = (1.0 - stretch_parm * -1);
+
+		pathdeform::DeformParms &curve_parms = deform_parms(i);
+		curve_parms.use_width = use_width;
+		curve_parms.interpolation = interp;
+		curve_parms.dist_scale = object_axis_size > 0.0 ? object_axis_size * stretch_mult : 0.0;
+		curve_parms.dist_bias = offset * arclen;
+		curve_parms.offset_scale = arclen;
+		curve_parms.stretch_scale = object_axis_size;
+		curve_parms.roll_cos = SYScos(roll_rad);
+		curve_parms.roll_sin = SYSsin(roll_rad);
+	}
 }
 
 void
 ThreadedDeform::
 operator()(const GA_SplittableRange &sr) const
 {
-	UT_Vector3D nextCurveP, prevCurveP, lerpCurveP;
-	UT_Vector3D nextCurveT, prevCurveT, lerpCurveT;
-	UT_Vector3D nextCurveBT, prevCurveBT, lerpCurveBT;
-	UT_Vector3D nextCurveUp, prevCurveUp, lerpCurveUp;
-	UT_Vector3  projection_point, projection_direction;
-	UT_Vector3 bbox_min = bbox.minvec();
-	UT_Vector3 bbox_max = bbox.maxvec();
-	UT_Matrix3D curve_basis;
 	GA_RWPageHandleV3 hndl_geo_p(attr_geo_p);
-	GA_RWPageHandleV3 hndl_geo_n(attr_geo_n);
 	GA_RWPageHandleV3 hndl_direction(attr_direction);
 	GA_RWPageHandleV3 hndl_normal(attr_normal);
 	GA_RWPageHandleV3 hndl_up(attr_up);
+	UT_Array<GA_RWPageHandleV3> hndl_vectors;
+	UT_Array<GA_RWPageHandleV4> hndl_quats;
+	hndl_vectors.setSize(vector_attribs.entries());
+	hndl_quats.setSize(quat_attribs.entries());
+	for (exint i = 0; i < vector_attribs.entries(); ++i)
+		hndl_vectors(i).bind(vector_attribs(i));
+	for (exint i = 0; i < quat_attribs.entries(); ++i)
+		hndl_quats(i).bind(quat_attribs(i));
+	GA_ROPageHandleF hndl_overrides[NUM_OVERRIDES];
+	for (int k = 0; k < NUM_OVERRIDES; ++k)
+	{
+		if (overrides.point_attribs[k])
+			hndl_overrides[k].bind(overrides.point_attribs[k]);
+	}
+	std::unique_ptr<pathdeform::DeformBlock> block(new pathdeform::DeformBlock);
+
+	// Binding a write handle detaches its page from the pages shared with
+	// the input, so pages without a deformed point are left shared
+	auto bind_page = [&](GA_Offset page_start)
+	{
+		hndl_geo_p.setPage(page_start);
+		hndl_direction.setPage(page_start);
+		hndl_normal.setPage(page_start);
+		hndl_up.setPage(page_start);
+		for (exint i = 0; i < hndl_vectors.entries(); ++i)
+			hndl_vectors(i).setPage(page_start);
+		for (exint i = 0; i < hndl_quats.entries(); ++i)
+			hndl_quats(i).setPage(page_start);
+		for (int k = 0; k < NUM_OVERRIDES; ++k)
+		{
+			if (hndl_overrides[k].isValid())
+				hndl_overrides[k].setPage(page_start);
+		}
+	};
 
 	for (GA_PageIterator pit = sr.beginPages(); !pit.atEnd(); ++pit)
 	{
 		GA_Offset block_offset_start, block_offset_end;
 		for(GA_Iterator it(pit.begin()); it.blockAdvance(block_offset_start, block_offset_end);)
 		{
-			hndl_geo_p.setPage(block_offset_start);
-			hndl_geo_n.setPage(block_offset_start);
-			hndl_direction.setPage(block_offset_start);
-			hndl_normal.setPage(block_offset_start);
-			hndl_up.setPage(block_offset_start);
-			for (GA_Offset ptof = block_offset_start; ptof < block_offset_end; ++ptof)
+			if (!point_curve)
+			{
+				bind_page(block_offset_start);
+				deformRun(block_offset_start, block_offset_end - block_offset_start, 0,
+						*block, hndl_geo_p, hndl_direction, hndl_normal, hndl_up,
+						hndl_vectors, hndl_quats, hndl_overrides);
+				continue;
+			}
+
+			// Split the block into runs of points following the same curve
+			bool bound = false;
+			GA_Offset run_start = block_offset_start;
+			while (run_start < block_offset_end)
 			{
-				// Find point projection on object axis
-				UT_Vector3 t0 = hndl_geo_p.get(ptof) - axis_pt0;
-				float t0_len = t0.length();
-				t0.normalize();
-				float angle = t0.dot(axis_vector);
-				float projection = angle * t0_len;
-				projection_point = axis_pt0 + axis_vector * projection;
-				projection_direction = hndl_geo_p.get(ptof) - projection_point;
-				float bbox_relpos = pointRelativeToBbox(hndl_geo_p.get(ptof), axis, bbox_min, bbox_max);
-				float u_position_on_curve = bbox_relpos * step;
-				u_position_on_curve += offset * (curve_num_points - 1);
-
-				unsigned int next_curve_pointnum = SYSmin(SYSceil(u_position_on_curve), (float) curve_num_points - 1);
-				unsigned int prev_curve_pointnum = SYSmin(SYSfloor(u_position_on_curve), (float) curve_num_points - 1);
-				double fraction = SYSfrac(u_position_on_curve);
-
-				// Import curve attribs
-				// Previous point
-				GA_Offset curve_offset = curveIndexMap.offsetFromIndex(next_curve_pointnum);
-				nextCurveP = hndl_curve_p.get(curve_offset);
-				nextCurveT = hndl_curve_tang.get(curve_offset);
-				nextCurveBT = hndl_curve_btang.get(curve_offset);
-				nextCurveUp = hndl_curve_up.get(curve_offset);
-
-				// Next point
-				curve_offset = curveIndexMap.offsetFromIndex(prev_curve_pointnum);
-				prevCurveP = hndl_curve_p.get(curve_offset);
-				prevCurveT = hndl_curve_tang.get(curve_offset);
-				prevCurveBT = hndl_curve_btang.get(curve_offset);
-				prevCurveUp = hndl_curve_up.get(curve_offset);
-
-				// Interpolated values
-				lerpCurveP = SYSlerp<double>(nextCurveP, prevCurveP, 1 - fraction);
-				lerpCurveT = SYSlerp<double>(nextCurveT, prevCurveT, 1 - fraction);
-				lerpCurveBT = SYSlerp<double>(nextCurveBT, prevCurveBT, 1 - fraction);
-				lerpCurveUp = SYSlerp<double>(nextCurveUp, prevCurveUp, 1 - fraction);
-
-				// Comstruct coordinate system
-				switch (axis)
+				int curve = point_curve[run_start];
+				GA_Offset run_end = run_start + 1;
+				while (run_end < block_offset_end && point_curve[run_end] == curve)
+					++run_end;
+				if (curve >= 0 && curves[curve].num_points >= 2)
 				{
-					case 0:
-						curve_basis = UT_Matrix3D(lerpCurveT[0], lerpCurveT[1], lerpCurveT[2],
-										lerpCurveUp[0], lerpCurveUp[1], lerpCurveUp[2],
-										-lerpCurveBT[0], -lerpCurveBT[1], -lerpCurveBT[2]);
-						break;
-					case 1:
-						curve_basis = UT_Matrix3D(lerpCurveUp[0], lerpCurveUp[1], lerpCurveUp[2],
-										lerpCurveT[0], lerpCurveT[1], lerpCurveT[2],
-										lerpCurveBT[0], lerpCurveBT[1], lerpCurveBT[2]);
-						break;
-					case 2:
-						curve_basis = UT_Matrix3D(lerpCurveBT[0], lerpCurveBT[1], lerpCurveBT[2],
-										lerpCurveUp[0], lerpCurveUp[1], lerpCurveUp[2],
-										-lerpCurveT[0], -lerpCurveT[1], -lerpCurveT[2]);
-						break;
+					if (!bound)
+						bind_page(block_offset_start);
+					bound = true;
+					deformRun(run_start, run_end - run_start, curve,
+							*block, hndl_geo_p, hndl_direction, hndl_normal, hndl_up,
+							hndl_vectors, hndl_quats, hndl_overrides);
 				}
-				projection_direction *= curve_basis;
-				
-				if (hndl_direction.isValid() && hndl_normal.isValid() && hndl_up.isValid()) {
-					hndl_direction.set(ptof, lerpCurveT);
-					hndl_normal.set(ptof, lerpCurveBT);
-					hndl_up.set(ptof, lerpCurveUp);
+				run_start = run_end;
+			}
+		}
+	}
+};
+
+void
+ThreadedDeform::deformRun(GA_Offset start, int count, int curve,
+		pathdeform::DeformBlock &block,
+		GA_RWPageHandleV3 &hndl_geo_p,
+		GA_RWPageHandleV3 &hndl_direction,
+		GA_RWPageHandleV3 &hndl_normal,
+		GA_RWPageHandleV3 &hndl_up,
+		UT_Array<GA_RWPageHandleV3> &hndl_vectors,
+		UT_Array<GA_RWPageHandleV4> &hndl_quats,
+		GA_ROPageHandleF *hndl_overrides) const
+{
+	const bool add_basis = !sample_p && hndl_direction.isValid() && hndl_normal.isValid() && hndl_up.isValid();
+	const bool transform_vattribs = !sample_p && (hndl_vectors.entries() > 0 || hndl_quats.entries() > 0);
+	const bool want_frames = add_basis || transform_vattribs;
+
+	// Point overrides, from the attribute pages or the promoted primitive values
+	const float *override_values[NUM_OVERRIDES];
+	bool use_overrides = false;
+	for (int k = 0; k < NUM_OVERRIDES; ++k)
+	{
+		override_values[k] = nullptr;
+		if (hndl_overrides[k].isValid())
+			override_values[k] = &hndl_overrides[k].value(start);
+		else if (overrides.prim_values[k].entries() > 0)
+			override_values[k] = overrides.prim_values[k].array() + start;
+		use_overrides |= override_values[k] != nullptr;
+	}
+	const pathdeform::PointOverrides point_overrides = {
+			override_values[OVERRIDE_OFFSET],
+			override_values[OVERRIDE_STRETCH],
+			override_values[OVERRIDE_ROLL]};
+
+	// Deform the whole run at once from the cached projection
+	float *block_p = sample_p ? sample_p + 3 * start : hndl_geo_p.value(start).data();
+	pathdeform::deformBlock(curves[curve], deform_parms[curve], want_frames, isa,
+			projection.relpos.array() + start,
+			projection.cu.array() + start,
+			projection.cb.array() + start,
+			block_p, count, block, use_overrides ? &point_overrides : nullptr);
+
+	if (!want_frames)
+		return;
+
+	if (add_basis)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			GA_Offset ptof = start + i;
+			hndl_direction.set(ptof, UT_Vector3(block.T[0][i], block.T[1][i], block.T[2][i]));
+			hndl_normal.set(ptof, UT_Vector3(block.B[0][i], block.B[1][i], block.B[2][i]));
+			hndl_up.set(ptof, UT_Vector3(block.Up[0][i], block.Up[1][i], block.Up[2][i]));
+		}
+	}
+
+	// Vector attributes, rotated in their pages by the frames of the block
+	for (exint i = 0; i < hndl_vectors.entries(); ++i)
+		pathdeform::reorientVectors(axis, block, hndl_vectors(i).value(start).data(), count);
+	for (exint i = 0; i < hndl_quats.entries(); ++i)
+		pathdeform::reorientQuaternions(axis, block, hndl_quats(i).value(start).data(), count);
+}
+
+void
+SOP_PathDeformVerb::reportTimings(const CookParms &cookparms, GU_Detail *gdp,
+		const CookTimings &timings)
+{
+	// Detail attribute and, for farm jobs, one JSON line per cook appended
+	// to the file named by PATHDEFORM_TIMINGS_LOG
+	const SOP_PathDeformParms &parms = cookparms.parms<SOP_PathDeformParms>();
+	const char *log_path = getenv("PATHDEFORM_TIMINGS_LOG");
+	const bool write_log = log_path && *log_path;
+	if (!parms.add_timings && !write_log)
+		return;
+
+	UT_String node_path;
+	if (cookparms.getNode())
+		cookparms.getNode()->getFullPath(node_path);
+	UT_WorkBuffer json;
+	timings.formatJSON(node_path, json);
+
+	if (parms.add_timings)
+	{
+		GA_RWHandleS hndl_timings(gdp->addStringTuple(GA_ATTRIB_DETAIL, "pathdeform_timings", 1));
+		if (hndl_timings.isValid())
+			hndl_timings.set(GA_Offset(0), json.buffer());
+	}
+
+	if (write_log)
+	{
+		// Compiled blocks cook several instances at once
+		static UT_Lock log_lock;
+		UT_AutoLock lock(log_lock);
+		FILE *log_file = fopen(log_path, "a");
+		if (log_file)
+		{
+			fprintf(log_file, "%s\n", json.buffer());
+			fclose(log_file);
+		}
+	}
+}
+
+static const char *packedRowNames[3] =
+{
+	"__pathdeform_xform0", "__pathdeform_xform1", "__pathdeform_xform2"
+};
+
+void
+SOP_PathDeformVerb::extractPackedTransforms(GU_Detail *gdp, GA_Attribute *rows[3])
+{
+	// The 3x3 transform of every packed primitive as three row vectors on
+	// its point. Rotated with the other vectors in the deform pass, the rows
+	// give the transform followed by the curve basis.
+	// Primitive ranges don't follow point pages, the pages are hardened up
+	// front so no two threads harden the same one
+	for (int r = 0; r < 3; ++r)
+	{
+		rows[r] = gdp->addFloatTuple(GA_ATTRIB_POINT, packedRowNames[r], 3);
+		rows[r]->hardenAllPages();
+	}
+	UTparallelFor(GA_SplittableRange(gdp->getPrimitiveRange()), [&](const GA_SplittableRange &range)
+	{
+		GA_RWHandleV3 hndl_rows[3];
+		for (int r = 0; r < 3; ++r)
+			hndl_rows[r].bind(rows[r]);
+		for (GA_Iterator it(range); !it.atEnd(); ++it)
+		{
+			const GA_Primitive *prim = gdp->getPrimitive(*it);
+			if (!GU_PrimPacked::isPackedPrimitive(*prim))
+				continue;
+			const GU_PrimPacked *packed = static_cast<const GU_PrimPacked *>(prim);
+			UT_Matrix3D xform;
+			packed->getLocalTransform(xform);
+			GA_Offset ptof = packed->getPointOffset(0);
+			for (int r = 0; r < 3; ++r)
+				hndl_rows[r].set(ptof, UT_Vector3(xform(r, 0), xform(r, 1), xform(r, 2)));
+		}
+	});
+}
+
+void
+SOP_PathDeformVerb::applyPackedTransforms(GU_Detail *gdp, GA_Attribute *rows[3])
+{
+	// Rows back into the packed primitives, the pivot moved with the point
+	UTparallelFor(GA_SplittableRange(gdp->getPrimitiveRange()), [&](const GA_SplittableRange &range)
+	{
+		GA_ROHandleV3 hndl_rows[3];
+		for (int r = 0; r < 3; ++r)
+			hndl_rows[r].bind(rows[r]);
+		for (GA_Iterator it(range); !it.atEnd(); ++it)
+		{
+			GA_Primitive *prim = gdp->getPrimitive(*it);
+			if (!GU_PrimPacked::isPackedPrimitive(*prim))
+				continue;
+			GU_PrimPacked *packed = static_cast<GU_PrimPacked *>(prim);
+			GA_Offset ptof = packed->getPointOffset(0);
+			UT_Matrix3D xform;
+			for (int r = 0; r < 3; ++r)
+			{
+				UT_Vector3 row = hndl_rows[r].get(ptof);
+				for (int c = 0; c < 3; ++c)
+					xform(r, c) = row[c];
+			}
+			packed->setLocalTransform(xform);
+		}
+	});
+	for (int r = 0; r < 3; ++r)
+		gdp->destroyAttribute(GA_ATTRIB_POINT, packedRowNames[r]);
+}
+
+void
+SOP_PathDeformVerb::findReorientAttribs(const SOP_PathDeformParms &parms, GU_Detail *gdp,
+		const GA_Attribute *attr_direction, const GA_Attribute *attr_normal,
+		const GA_Attribute *attr_up, UT_Array<GA_Attribute *> &vector_attribs,
+		UT_Array<GA_Attribute *> &quat_attribs)
+{
+	// Float point attributes from the vattribs pattern: 3 components are
+	// vectors or normals (N, v, up), 4 components orientations (orient).
+	// The basis attributes are written from the frames, never reoriented.
+	vector_attribs.clear();
+	quat_attribs.clear();
+	if (!parms.deform_vattribs || !parms.vattribs.isstring())
+		return;
+
+	UT_Array<GA_Attribute *> vattribs_array;
+	GOP_AttribListParse::parseAttribList(gdp->pointAttribs(), parms.vattribs.c_str(), vattribs_array);
+	for (exint i = 0; i < vattribs_array.entries(); ++i)
+	{
+		GA_Attribute *attr = vattribs_array(i);
+		if (attr == attr_direction || attr == attr_normal || attr == attr_up)
+			continue;
+		if (attr->isDetached() || attr == gdp->getP())
+			continue;
+		if (attr->getStorageClass() != GA_STORECLASS_FLOAT)
+			continue;
+		int tuple_size = attr->getTupleSize();
+		if (tuple_size == 3)
+		{
+			if (attr->getTypeInfo() == GA_TYPE_VOID)
+				attr->setTypeInfo(GA_TYPE_VECTOR);
+			vector_attribs.append(attr);
+		}
+		else if (tuple_size == 4)
+		{
+			if (attr->getTypeInfo() == GA_TYPE_VOID)
+				attr->setTypeInfo(GA_TYPE_QUATERNION);
+			quat_attribs.append(attr);
+		}
+	}
+}
+
+void
+SOP_PathDeformVerb::deformShutterSamples(const SOP_PathDeformParms &parms, SOP_PathDeformCache &cache,
+		GU_Detail *gdp, exint num_curves, const UT_Array<pathdeform::CurveSamples> &curves,
+		pathdeform::KernelISA isa)
+{
+	// Deformation at every shutter sample in the same cook. Projection,
+	// frames and pieces are shared, only offset, stretch and roll change,
+	// as evaluated by the parms. P holds the first sample, at the cook time.
+	const int num_samples = parms.sample_offset.entries();
+	const fpreal shutter_time = parms.shutter_time;
+	const bool add_velocity = parms.add_velocity;
+	const bool add_sample_p = parms.add_sample_p;
+	const PointProjectionCache &point_cache = cache.point_cache;
+	if (!add_velocity && !add_sample_p)
+		return;
+
+	GA_Attribute *attr_geo_p = gdp->getP();
+	GA_RWHandleV3 hndl_v;
+	GA_RWHandleF hndl_sample_p;
+	if (add_velocity)
+	{
+		GA_Attribute *attr_v = gdp->addFloatTuple(GA_ATTRIB_POINT, "v", 3);
+		attr_v->setTypeInfo(GA_TYPE_VECTOR);
+		hndl_v.bind(attr_v);
+	}
+	if (add_sample_p)
+		hndl_sample_p.bind(gdp->addFloatTuple(GA_ATTRIB_POINT, "Pblur", 3 * num_samples));
+
+	// Points no curve deforms keep their position in every sample
+	const GA_SplittableRange sr(gdp->getPointRange());
+	UT_Array<float> sample_p;
+	sample_p.setSize(3 * gdp->getNumPointOffsets());
+	UTparallelFor(sr, [&](const GA_SplittableRange &r)
+	{
+		GA_ROPageHandleV3 hndl_geo_p(attr_geo_p);
+		GA_Offset start, end;
+		for (GA_Iterator it(r); it.blockAdvance(start, end);)
+		{
+			hndl_geo_p.setPage(start);
+			const float *src = hndl_geo_p.value(start).data();
+			std::copy(src, src + 3 * (end - start), sample_p.array() + 3 * start);
+		}
+	});
+
+	UT_Array<pathdeform::DeformParms> deform_parms;
+	UT_Array<GA_Attribute *> no_attribs;
+	for (int sample = 0; sample < num_samples; ++sample)
+	{
+		// The first sample is the deformed P itself
+		if (sample > 0)
+		{
+			computeDeformParms(parms, parms.sample_offset(sample), parms.sample_stretch(sample),
+					parms.sample_roll(sample), cache, num_curves, deform_parms);
+			ThreadedDeform td(
+					attr_geo_p,
+					nullptr,
+					nullptr,
+					nullptr,
+					curves.array(),
+					deform_parms.array(),
+					point_cache,
+					parms.multi_curve ? point_cache.point_curve.array() : nullptr,
+					isa,
+					no_attribs,
+					no_attribs,
+					cache.point_overrides,
+					parms.axis,
+					sample_p.array());
+			UTparallelFor(sr, td);
+		}
+
+		const bool last = sample == num_samples - 1;
+		if (!add_sample_p && !last)
+			continue;
+		UTparallelFor(sr, [&](const GA_SplittableRange &r)
+		{
+			for (GA_Iterator it(r); !it.atEnd(); ++it)
+			{
+				GA_Offset ptof = *it;
+				UT_Vector3 pos = gdp->getPos3(ptof);
+				if (sample > 0)
+					pos.assign(sample_p(3 * ptof), sample_p(3 * ptof + 1), sample_p(3 * ptof + 2));
+				if (add_sample_p)
+				{
+					for (int c = 0; c < 3; ++c)
+						hndl_sample_p.set(ptof, 3 * sample + c, pos[c]);
 				}
-				
-				if (use_width && hndl_curve_width.isValid())
+				if (add_velocity && last)
 				{
-					double w1, w2;
-					curve_offset = curveIndexMap.offsetFromIndex(next_curve_pointnum);
-					w1 = hndl_curve_width.get(curve_offset);
-					curve_offset = curveIndexMap.offsetFromIndex(prev_curve_pointnum);
-					w2 = hndl_curve_width.get(curve_offset);
-					projection_direction *= SYSlerp(w1, w2, (1 - fraction));
+					UT_Vector3 v(0, 0, 0);
+					if (shutter_time > 0.0)
+						v = (pos - gdp->getPos3(ptof)) / shutter_time;
+					hndl_v.set(ptof, v);
 				}
-				lerpCurveP += projection_direction;
-				hndl_geo_p.set(ptof, lerpCurveP);
-				
+			}
+		});
+	}
+}
+
+void
+SOP_PathDeformVerb::recomputeNormals(GU_Detail *gdp, GA_Attribute *attr_geo_n, const int *point_curve,
+		SOP_PathDeformCache &cache)
+{
+	PointAdjacencyCache &adjacency_cache = cache.adjacency_cache;
+	// Point to primitive adjacency, rebuilt only on topology changes
+	UT_Array<fpreal64> adjacency_key;
+	adjacency_key.append(gdp->getUniqueId());
+	adjacency_key.append(gdp->getTopology().getDataId());
+	adjacency_key.append(gdp->getPrimitiveList().getDataId());
+	adjacency_key.append(gdp->getNumPointOffsets());
+	adjacency_key.append(gdp->getNumPrimitiveOffsets());
+	if (adjacency_key != cache.adjacency_cache_key)
+	{
+		// Vertex count of every point from its vertex list, in parallel
+		// over the points, so the rows need no reduction between threads
+		const exint num_offsets = gdp->getNumPointOffsets();
+		UT_Array<exint> &point_start = adjacency_cache.point_start;
+		point_start.setSize(num_offsets + 1);
+		point_start.constant(0);
+		const GA_SplittableRange point_range(gdp->getPointRange());
+		UTparallelFor(point_range, [&](const GA_SplittableRange &r)
+		{
+			for (GA_Iterator it(r); !it.atEnd(); ++it)
+			{
+				exint count = 0;
+				for (GA_Offset vtx = gdp->pointVertex(*it); GAisValid(vtx); vtx = gdp->vertexToNextVertex(vtx))
+					++count;
+				point_start(*it + 1) = count;
+			}
+		});
 
-				if (deform_vattribs)
+		// Prefix sum over page sized blocks: block totals in parallel, a
+		// serial scan of the totals, then every block in parallel
+		const exint num_blocks = (num_offsets + GA_PAGE_SIZE - 1) / GA_PAGE_SIZE;
+		UT_Array<exint> block_start;
+		block_start.setSize(num_blocks + 1);
+		block_start(0) = 0;
+		UTparallelFor(UT_BlockedRange<exint>(0, num_blocks), [&](const UT_BlockedRange<exint> &r)
+		{
+			for (exint b = r.begin(); b < r.end(); ++b)
+			{
+				exint sum = 0;
+				for (exint i = b * GA_PAGE_SIZE; i < SYSmin((b + 1) * GA_PAGE_SIZE, num_offsets); ++i)
+					sum += point_start(i + 1);
+				block_start(b + 1) = sum;
+			}
+		});
+		for (exint b = 0; b < num_blocks; ++b)
+			block_start(b + 1) += block_start(b);
+		UTparallelFor(UT_BlockedRange<exint>(0, num_blocks), [&](const UT_BlockedRange<exint> &r)
+		{
+			for (exint b = r.begin(); b < r.end(); ++b)
+			{
+				exint sum = block_start(b);
+				for (exint i = b * GA_PAGE_SIZE; i < SYSmin((b + 1) * GA_PAGE_SIZE, num_offsets); ++i)
 				{
-					if (aref_map.entries() > 0)
-					{
-						UT_Matrix4D m,im;
-						m = curve_basis;
-						m.invert(im);
-						aref_map.transform(m, im, GA_ATTRIB_POINT, ptof);
-					}
+					sum += point_start(i + 1);
+					point_start(i + 1) = sum;
 				}
 			}
-		}
+		});
+
+		// Every point fills its own row
+		adjacency_cache.prims.setSize(point_start(num_offsets));
+		UTparallelFor(point_range, [&](const GA_SplittableRange &r)
+		{
+			for (GA_Iterator it(r); !it.atEnd(); ++it)
+			{
+				exint row = point_start(*it);
+				for (GA_Offset vtx = gdp->pointVertex(*it); GAisValid(vtx); vtx = gdp->vertexToNextVertex(vtx))
+					adjacency_cache.prims(row++) = gdp->vertexPrimitive(vtx);
+			}
+		});
+		cache.adjacency_cache_key = adjacency_key;
 	}
-};
 
+	// Area weighted primitive normals, then their sum around every point.
+	// Points no curve moved keep their normal.
+	UT_Array<UT_Vector3> &prim_normals = adjacency_cache.prim_normals;
+	prim_normals.setSize(gdp->getNumPrimitiveOffsets());
+	UTparallelFor(GA_SplittableRange(gdp->getPrimitiveRange()), [&](const GA_SplittableRange &r)
+	{
+		for (GA_Iterator it(r); !it.atEnd(); ++it)
+		{
+			const GEO_Primitive *prim = gdp->getGEOPrimitive(*it);
+			UT_Vector3 n = prim->computeNormal();
+			if (prim->getTypeDef().getFamilyMask() & GA_FAMILY_FACE)
+				n *= prim->calcArea();
+			prim_normals(*it) = n;
+		}
+	});
+
+	const exint *point_start = adjacency_cache.point_start.array();
+	const GA_Offset *prims = adjacency_cache.prims.array();
+	UTparallelFor(GA_SplittableRange(gdp->getPointRange()), [&](const GA_SplittableRange &r)
+	{
+		GA_RWPageHandleV3 hndl_n(attr_geo_n);
+		GA_Offset start, end;
+		for (GA_Iterator it(r); it.blockAdvance(start, end);)
+		{
+			hndl_n.setPage(start);
+			for (GA_Offset ptof = start; ptof < end; ++ptof)
+			{
+				if (point_curve && point_curve[ptof] < 0)
+					continue;
+				UT_Vector3 n(0, 0, 0);
+				for (exint i = point_start[ptof]; i < point_start[ptof + 1]; ++i)
+					n += prim_normals(prims[i]);
+				n.normalize();
+				hndl_n.set(ptof, n);
+			}
+		}
+	});
+}
 
-OP_ERROR
-PathDeform::cookMySop(OP_Context &context)
+void
+SOP_PathDeformVerb::cook(const CookParms &cookparms) const
 {
-	if (lockInput(0, context) >= UT_ERROR_ABORT)
+	const std::chrono::steady_clock::time_point cook_start = std::chrono::steady_clock::now();
+	const SOP_PathDeformParms &parms = cookparms.parms<SOP_PathDeformParms>();
+	SOP_PathDeformCache &cache = *static_cast<SOP_PathDeformCache *>(cookparms.cache());
+	CookTimings timings;
+	timings.clear();
+	pathdeform::CurveCache &curve_cache = cache.curve_cache;
+	PointProjectionCache &point_cache = cache.point_cache;
+
+	GU_Detail *gdp = cookparms.gdh().gdpNC();
+	const GU_Detail *input_gdp = cookparms.inputGeo(0);
+	const GU_Detail *curve_gdp = cookparms.inputGeo(1);
+	if (!curve_gdp)
 	{
-		return error();
+		cookparms.sopAddError(SOP_ERR_INVALID_SRC, "No second input");
+		return;
 	}
 
-	if (lockInput(1, context) >= UT_ERROR_ABORT)
+	// Output starts as a copy of the first input
 	{
-		addError(SOP_ERR_INVALID_SRC, "No second input");
-		return error();
+		ScopedStageTimer timer(timings, STAGE_COPY);
+		// Packed transforms are not attributes, they are restored with a
+		// full copy
+		copyInput(parms.copy_changed && parms.deform_mode != DEFORM_PACKED,
+				input_gdp, gdp, cache.copy_cache);
 	}
 
-	duplicatePointSource(0, context, gdp);
-	fpreal time = context.getTime();
-	GU_Detail *curve_gdp = new GU_Detail(inputGeo(1, context));
+	// Parms
+	int multi_curve = parms.multi_curve;
+    int recompute_n = parms.recompute_n;
+    int axis = parms.axis;
+	CurveFrameParms frame_parms;
+	frame_parms.frame_mode = parms.frame_mode;
+	frame_parms.use_up_vector = parms.use_up_vector;
+	frame_parms.up_vector = UT_Vector3(parms.up_vector);
+	frame_parms.use_twist = parms.use_curve_twist;
 
-	GEO_Primitive *curve_geo_prim = curve_gdp->getGEOPrimitive(curve_gdp->primitiveOffset(0));
-	if (!curve_geo_prim)
+	// Curves, a single one or every face primitive in multi curve mode.
+	// NURBS and Bezier curves are faces too, their sample count is only
+	// known once baked.
+	if (curve_gdp->getNumPrimitives() == 0)
 	{
-		addError(OP_ERR_INVALID_SRC, "Can't find curve primitive");
-        return error();
+		cookparms.sopAddError(OP_ERR_INVALID_SRC, "Can't find curve primitive");
+        return;
 	}
-	else if (curve_geo_prim->getTypeDef().getFamilyMask() != GA_FAMILY_FACE)
+	exint num_curves = multi_curve ? curve_gdp->getNumPrimitives() : 1;
+	UT_Array<const GEO_Face *> curve_prims;
+	UT_Array<unsigned int> curve_num_points;
+	UT_Array<unsigned char> curve_closed;
+	for (exint i = 0; i < num_curves; ++i)
 	{
-
-		addError(OP_ERR_INVALID_SRC, "Primitive is not a polycurve type");
-		return error();
+		const GEO_Face *face = nullptr;
+		const GEO_Primitive *prim = curve_gdp->getGEOPrimitive(curve_gdp->primitiveOffset(i));
+		if (prim && (prim->getTypeDef().getFamilyMask() & GA_FAMILY_FACE))
+			face = static_cast<const GEO_Face *>(prim);
+		const bool closed = face && face->isClosed() && face->getVertexCount() > 1;
+		const bool poly = face && !isSplineCurve(face);
+		curve_prims.append(face);
+		curve_num_points.append(poly ? face->getVertexCount() + (closed ? 1 : 0) : 0);
+		curve_closed.append(closed);
 	}
 
-	// Parms
-	int use_width = PARM_USEWIDTH();
-    int stretch_tolen = PARM_STRETCH_TOLEN();
-    int recompute_n = PARM_COMPUTE_N();
-    int deform_vattribs = PARM_DEFORM_VECTORS();
-    int axis = PARM_AXIS();
-    float offset = PARM_OFFSET(time);
+	if (!multi_curve && !curve_prims(0))
+	{
+
+		cookparms.sopAddError(OP_ERR_INVALID_SRC, "Primitive is not a curve");
+		return;
+	}
 
 	// Geometry attributes
-	hndl_curve_tang  = curve_gdp->addFloatTuple(GA_ATTRIB_POINT, "tang", 3);
-	hndl_curve_btang = curve_gdp->addFloatTuple(GA_ATTRIB_POINT, "btang", 3);
-	hndl_curve_up = curve_gdp->addFloatTuple(GA_ATTRIB_POINT, "up", 3);
-	hndl_curve_p = curve_gdp->getP();
-	hndl_curve_twist = curve_gdp->findPointAttribute("twist");
-	hndl_curve_width = curve_gdp->findPointAttribute("width");
+	GA_ROHandleV3 hndl_curve_p(curve_gdp->getP());
+	GA_ROHandleF hndl_curve_twist(curve_gdp->findPointAttribute("twist"));
+	GA_ROHandleF hndl_curve_width(curve_gdp->findPointAttribute("width"));
 	GA_Attribute *attr_geo_n = gdp->findNormalAttribute(GA_ATTRIB_POINT);
 	GA_Attribute *attr_geo_p = gdp->getP();
 
 	GA_Attribute *attr_direction = nullptr;
 	GA_Attribute *attr_normal = nullptr;
 	GA_Attribute *attr_up = nullptr;
-	if (PARM_ADD_BASIS_ATTR() != 0) {
+	if (parms.add_basis_attribs) {
 		attr_direction = gdp->addFloatTuple(GA_ATTRIB_POINT, "dir", 3);
 		attr_normal = gdp->addFloatTuple(GA_ATTRIB_POINT, "normal", 3);
 		attr_up = gdp->addFloatTuple(GA_ATTRIB_POINT, "up", 3);
 	}
 
-	GEO_Curve *geocurve_prim = static_cast<GEO_Curve*>(curve_geo_prim);
-	computeCurveAttributes(geocurve_prim, time);
-	float arclen = geocurve_prim->calcPerimeter();
-	unsigned int curve_num_points = geocurve_prim->getPointRange().getEntries();
+	// Curve frames, every curve in parallel, into the buffers kept from
+	// the previous cook. Only rebuilt when the curves or the frame settings
+	// change; the curve input itself is never modified.
+	UT_Array<fpreal64> curve_key;
+	curve_key.append(curve_gdp->getUniqueId());
+	curve_key.append(attribDataId(curve_gdp->getP()));
+	curve_key.append(curve_gdp->getTopology().getDataId());
+	curve_key.append(curve_gdp->getPrimitiveList().getDataId());
+	curve_key.append(attribDataId(curve_gdp->findPointAttribute("twist")));
+	curve_key.append(attribDataId(curve_gdp->findPointAttribute("width")));
+	curve_key.append(multi_curve);
+	curve_key.append(frame_parms.frame_mode);
+	curve_key.append(frame_parms.use_up_vector);
+	curve_key.append(frame_parms.up_vector.x());
+	curve_key.append(frame_parms.up_vector.y());
+	curve_key.append(frame_parms.up_vector.z());
+	curve_key.append(frame_parms.use_twist);
+	curve_key.append(parms.curve_tolerance);
+	if (curve_key != cache.curve_cache_key)
+	{
+		ScopedStageTimer timer(timings, STAGE_CURVES);
+		cache.curve_cache_key.clear();
 
-	// Main
-	UT_BoundingBox bbox;
-	gdp->getBBox(&bbox);
-	bbox_min = bbox.minvec();
-	bbox_max = bbox.maxvec();
-	UT_Vector3 axis_pt0, axis_pt1;
-	computeBboxAxis(axis, axis_pt0, axis_pt1);
-	UT_Vector3 axis_vector = axis_pt1 - axis_pt0;
-	axis_vector.normalize();
-
-    float stretch_mult;
-	float object_axis_size = bbox.sizeAxis(axis);
-    if (stretch_tolen)
-        stretch_mult = arclen / object_axis_size;
-    else
-        stretch_mult = (1.0 - PARM_STRETCH(time) * -1);
-	object_axis_size *= stretch_mult;
-	float segment_length = arclen / curve_num_points;
-	float step = object_axis_size / segment_length; // how many cuve points in object length
-
-    // Parse string parameter and make AttribRefMap for vector attribs to deform
-    GA_AttributeRefMap aref_map((GA_Detail &)gdp);
-    GA_AttributeRefMap::ThreadHarden harden(aref_map); // make aref_map thread safe
-    if (PARM_DEFORM_VECTORS())
-    {
-    	UT_String vecattribs_str;
-    	PARM_REORIENT_ATTRIBS(vecattribs_str);
-    	if (vecattribs_str.length() != 0)
-    	{
-    		UT_Array<GA_Attribute *> vattribs_array;
-    		GOP_AttribListParse::parseAttribList(gdp->pointAttribs(), vecattribs_str, vattribs_array);
-    		if (!vattribs_array.isEmpty())
-    		{
-    			for(exint i = 0; i < vattribs_array.entries(); ++i)
-    			{
-    				GA_Attribute *attr = vattribs_array(i);
-    				attr->setTypeInfo(GA_TYPE_VECTOR);
-                    aref_map.appendDest(attr);
-    			}
-    		}
-    	}
-    }
-
-	// Deformation.
+		// Splines baked to adaptive samples first, for their counts
+		std::vector<SplineSamples> splines(num_curves);
+		UTparallelFor(UT_BlockedRange<exint>(0, num_curves), [&](const UT_BlockedRange<exint> &r)
+		{
+			for (exint i = r.begin(); i < r.end(); ++i)
+			{
+				if (!curve_prims(i) || !isSplineCurve(curve_prims(i)))
+					continue;
+				bakeSplineSamples(curve_prims(i), parms.curve_tolerance, splines[i]);
+				curve_num_points(i) = splines[i].u.size();
+			}
+		});
+
+		curve_cache.resize(curve_num_points.array(), curve_num_points.entries(), curve_closed.array());
+		UTparallelFor(UT_BlockedRange<exint>(0, num_curves), [&](const UT_BlockedRange<exint> &r)
+		{
+			for (exint i = r.begin(); i < r.end(); ++i)
+			{
+				if (!curve_prims(i) || curve_num_points(i) == 0)
+					continue;
+				if (isSplineCurve(curve_prims(i)))
+					packSplineSamples(curve_prims(i), i, splines[i], hndl_curve_twist,
+							hndl_curve_width, curve_cache);
+				else
+					packCurveSamples(curve_prims(i), i, hndl_curve_p, hndl_curve_twist,
+							hndl_curve_width, curve_cache);
+				computeCurveFrames(curve_prims(i), i, frame_parms, curve_cache);
+			}
+		});
+		cache.curve_cache_key = curve_key;
+	}
+
+	if (!multi_curve && (curve_cache.curveEntries(0) < 2 || curve_cache.curveLength(0) <= 0.0))
+	{
+		cookparms.sopAddError(OP_ERR_INVALID_SRC, "Curve must have at least two distinct points");
+		return;
+	}
+
+	// Points to curves, only rebuilt when the pieces or the curve list change
+	const UT_StringHolder &piece_name = parms.piece_attrib;
+	UT_Array<fpreal64> piece_key;
+	piece_key.append(multi_curve);
+	piece_key.append(input_gdp->getUniqueId());
+	piece_key.append(input_gdp->getTopology().getDataId());
+	piece_key.append(gdp->getNumPointOffsets());
+	if (multi_curve)
+	{
+		piece_key.append(attribDataId(input_gdp->findIntTuple(GA_ATTRIB_POINT, "curveid", 1)));
+		piece_key.append(attribDataId(input_gdp->findIntTuple(GA_ATTRIB_PRIMITIVE, "curveid", 1)));
+		piece_key.append(piece_name.hash());
+		piece_key.append(attribDataId(input_gdp->findIntTuple(GA_ATTRIB_POINT, piece_name, 1)));
+		piece_key.append(attribDataId(input_gdp->findIntTuple(GA_ATTRIB_PRIMITIVE, piece_name, 1)));
+		piece_key.append(curve_gdp->getUniqueId());
+		piece_key.append(curve_gdp->getPrimitiveList().getDataId());
+		piece_key.append(attribDataId(curve_gdp->findIntTuple(GA_ATTRIB_PRIMITIVE, piece_name, 1)));
+	}
+	if (piece_key != cache.piece_cache_key)
+	{
+		ScopedStageTimer timer(timings, STAGE_PIECES);
+		cache.piece_cache_key.clear();
+		cache.bounds_cache_key.clear();
+		if (multi_curve && !mapPiecesToCurves(cookparms, gdp, curve_gdp, piece_name, num_curves,
+				point_cache.point_curve))
+			return;
+		cache.piece_cache_key = piece_key;
+	}
+
+	// Bounding boxes, only rebuilt when positions or pieces change
+	UT_Array<fpreal64> bounds_key(piece_key);
+	bounds_key.append(attribDataId(input_gdp->getP()));
+	if (bounds_key != cache.bounds_cache_key)
+	{
+		ScopedStageTimer timer(timings, STAGE_BOUNDS);
+		computePieceBounds(gdp, multi_curve, num_curves, point_cache);
+		cache.bounds_cache_key = bounds_key;
+		cache.projection_cache_key.clear();
+	}
+
+	// Projection of the points on the object axis, the relative coordinates
+	// are kept so the deform pass only looks them up
+	UT_Array<fpreal64> projection_key(bounds_key);
+	projection_key.append(axis);
+	if (projection_key != cache.projection_cache_key)
+	{
+		ScopedStageTimer timer(timings, STAGE_PROJECTION);
+		computePointProjection(gdp, axis, multi_curve, num_curves, point_cache);
+		cache.projection_cache_key = projection_key;
+	}
+
+	// Curve samples, and the bbox relative coordinate to distance along the
+	// curve per curve
+	UT_Array<pathdeform::CurveSamples> curves;
+	UT_Array<pathdeform::DeformParms> deform_parms;
+	curves.setSize(num_curves);
+	for (exint i = 0; i < num_curves; ++i)
+	{
+		curves(i) = curve_cache.samples(i);
+		if (!point_cache.piece_bounds(i).isValid())
+			curves(i).num_points = 0; // no points follow this curve
+	}
+	computeDeformParms(parms, parms.offset, parms.stretch, parms.roll, cache, num_curves, deform_parms);
+	findPointOverrides(parms, gdp, cache.point_overrides);
+
+	// Vector and orientation attributes reoriented in the deform pass
+	UT_Array<GA_Attribute *> vector_attribs;
+	UT_Array<GA_Attribute *> quat_attribs;
+	findReorientAttribs(parms, gdp, attr_direction, attr_normal, attr_up, vector_attribs, quat_attribs);
+	int normal_mode = parms.normal_mode;
+	if (recompute_n && attr_geo_n && normal_mode == NORMALS_ROTATE
+			&& vector_attribs.find(attr_geo_n) < 0)
+		vector_attribs.append(attr_geo_n);
+
+	// Input attributes modified from here on are copied again next cook
+	UT_StringArray &written_attribs = cache.copy_cache.written_attribs;
+	written_attribs.append(attr_geo_p->getName());
+	if (recompute_n && attr_geo_n)
+		written_attribs.append(attr_geo_n->getName());
+	for (exint i = 0; i < vector_attribs.entries(); ++i)
+		written_attribs.append(vector_attribs(i)->getName());
+	for (exint i = 0; i < quat_attribs.entries(); ++i)
+		written_attribs.append(quat_attribs(i)->getName());
+	if (parms.add_basis_attribs)
+	{
+		written_attribs.append(attr_direction->getName());
+		written_attribs.append(attr_normal->getName());
+		written_attribs.append(attr_up->getName());
+	}
+	if (parms.motion_blur)
+	{
+		written_attribs.append("v");
+		written_attribs.append("Pblur");
+	}
+	if (parms.add_timings)
+		written_attribs.append("pathdeform_timings");
+
+	// Instances only rotate, packed transforms and orient follow the frames
+	GA_Attribute *packed_rows[3] = {nullptr, nullptr, nullptr};
+	if (parms.deform_mode == DEFORM_PACKED)
+	{
+		extractPackedTransforms(gdp, packed_rows);
+		for (int r = 0; r < 3; ++r)
+			vector_attribs.append(packed_rows[r]);
+	}
+	else if (parms.deform_mode == DEFORM_INSTANCES)
+	{
+		GA_Attribute *attr_orient = gdp->findFloatTuple(GA_ATTRIB_POINT, "orient", 4);
+		if (!attr_orient)
+		{
+			static const fpreal32 identity[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+			attr_orient = gdp->addFloatTuple(GA_ATTRIB_POINT, "orient", 4, GA_Defaults(identity, 4));
+			attr_orient->setTypeInfo(GA_TYPE_QUATERNION);
+		}
+		if (quat_attribs.find(attr_orient) < 0)
+			quat_attribs.append(attr_orient);
+		written_attribs.append(attr_orient->getName());
+	}
+
+	// Deformation, all pieces in one pass.
     const GA_SplittableRange sr(gdp->getPointRange());
-	const GA_IndexMap &curveIndexMap = curve_gdp->getPointMap();
+	pathdeform::KernelISA isa = pathdeform::resolveKernelISA(
+			static_cast<pathdeform::KernelISA>(parms.kernel));
 	ThreadedDeform td(
 			attr_geo_p,
-			attr_geo_n,
 			attr_direction,
 			attr_normal,
 			attr_up,
-			hndl_curve_tang,
-			hndl_curve_btang,
-			hndl_curve_up,
-			hndl_curve_p,
-			hndl_curve_twist,
-			hndl_curve_width,
-			aref_map,
-			curveIndexMap,
-			use_width,
-			stretch_tolen,
-			deform_vattribs,
-			axis,
-			offset,
-			step,
-			curve_num_points,
-			bbox,
-			axis_vector,
-			axis_pt0,
-			axis_pt1);
-
-	UTparallelFor(sr, td);
-	//UTserialFor(sr, td);
-	if (recompute_n)
-	{
-		if (attr_geo_n)
-			gdp->normal();
-	}
-	//gdp->clearAndDestroy();
-	//gdp->merge(*curve_gdp);
-
-
-	unlockInputs();
-	delete curve_gdp;
-	return error();
+			curves.array(),
+			deform_parms.array(),
+			point_cache,
+			multi_curve ? point_cache.point_curve.array() : nullptr,
+			isa,
+			vector_attribs,
+			quat_attribs,
+			cache.point_overrides,
+			axis);
+
+	// Workers that ran a part of the deform, for the cook report
+	UT_ThreadSpecificValue<int> deform_workers;
+	{
+		ScopedStageTimer timer(timings, STAGE_DEFORM);
+		UTparallelFor(sr, [&](const GA_SplittableRange &r)
+		{
+			deform_workers.get() = 1;
+			td(r);
+		});
+		//UTserialFor(sr, td);
+		if (parms.deform_mode == DEFORM_PACKED)
+			applyPackedTransforms(gdp, packed_rows);
+	}
+
+	if (parms.motion_blur)
+	{
+		ScopedStageTimer timer(timings, STAGE_MOTION_BLUR);
+		deformShutterSamples(parms, cache, gdp, num_curves, curves, isa);
+	}
+	if (recompute_n && attr_geo_n && normal_mode == NORMALS_RECOMPUTE)
+	{
+		ScopedStageTimer timer(timings, STAGE_NORMALS);
+		recomputeNormals(gdp, attr_geo_n, multi_curve ? point_cache.point_curve.array() : nullptr, cache);
+	}
+
+	// Cook report
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - cook_start;
+	timings.total_seconds = elapsed.count();
+	timings.num_points = gdp->getNumPoints();
+	timings.num_threads = 0;
+	for (UT_ThreadSpecificValue<int>::const_iterator it = deform_workers.begin(); it != deform_workers.end(); ++it)
+		timings.num_threads += it.get();
+	timings.time = parms.cook_time;
+	cache.timings = timings;
+	reportTimings(cookparms, gdp, timings);
+
+	// Everything this cook wrote gets a new data ID, the rest keeps the one
+	// of the copy
+	for (exint i = 0; i < written_attribs.entries(); ++i)
+	{
+		GA_Attribute *attr = gdp->findPointAttribute(written_attribs(i));
+		if (!attr)
+			attr = gdp->findGlobalAttribute(written_attribs(i));
+		if (attr)
+			attr->bumpDataId();
+	}
+	if (parms.deform_mode == DEFORM_PACKED)
+		gdp->getPrimitiveList().bumpDataId();
 }
 
 //void
@@ -11,7 +11,275 @@
 #include <UT/UT_DSOVersion.h>
 #include <OP/OP_Node.h>
 #include <SOP/SOP_Node.h>
+#include <SOP/SOP_NodeVerb.h>
 #include <OP/OP_Parameters.h>
+#include <UT/UT_Array.h>
+#include <UT/UT_WorkBuffer.h>
+#include <UT/UT_StringArray.h>
+#include <chrono>
+#include "pathdeform_core.h"
+
+// Per-point projection on the object axis, indexed by point offset. Only
+// depends on input 0 positions, the axis and the piece assignment, so it
+// survives cooks that only change offset, stretch or roll.
+struct PointProjectionCache
+{
+	UT_Array<float> relpos;      // bbox relative coordinate along the axis
+	UT_Array<float> cu;          // radial offset along the curve up vector
+	UT_Array<float> cb;          // radial offset along the curve bitangent
+	UT_Array<int> point_curve;   // curve of every point, multi curve mode only
+	UT_Array<UT_BoundingBox> piece_bounds;
+	UT_Array<pathdeform::ProjectParms> project_parms;
+};
+
+// Primitives around every point, compressed rows indexed by point offset.
+// Only depends on the topology, so normals are recomputed without walking
+// the vertex lists again every cook.
+struct PointAdjacencyCache
+{
+	UT_Array<exint> point_start;   // num point offsets + 1 entries
+	UT_Array<GA_Offset> prims;
+	UT_Array<UT_Vector3> prim_normals; // area weighted, by primitive offset
+};
+
+// Per-point additions to offset, stretch and roll from the pathoffset,
+// pathstretch and pathroll attributes.
+enum PointOverride
+{
+	OVERRIDE_OFFSET = 0,
+	OVERRIDE_STRETCH,
+	OVERRIDE_ROLL,
+	NUM_OVERRIDES
+};
+
+// Point attributes are read from their pages in the deform pass, primitive
+// ones are promoted to arrays by point offset first.
+struct PointOverrideAttribs
+{
+	const GA_Attribute *point_attribs[NUM_OVERRIDES];
+	UT_Array<float> prim_values[NUM_OVERRIDES]; // empty if not from a primitive attribute
+};
+
+// What the deform moves. Packed primitives and instance points only have
+// their pivot deformed, their orientation follows the curve frames.
+enum DeformMode
+{
+	DEFORM_POINTS = 0,
+	DEFORM_PACKED,      // pivot and 3x3 transform of packed primitives
+	DEFORM_INSTANCES    // points with an orient attribute, created if missing
+};
+
+enum NormalMode
+{
+	NORMALS_ROTATE = 0,   // N rotated by the curve basis in the deform pass
+	NORMALS_RECOMPUTE     // N rebuilt from the deformed primitives
+};
+
+// Input 0 attributes as the last cook left them in the output. When the
+// topology and groups are unchanged, the next cook only copies the
+// attributes whose data ID changed or that the deform wrote. Copies share
+// the input pages copy-on-write, so the output only owns the pages the
+// deform wrote.
+struct InputAttribRecord
+{
+	GA_AttributeOwner owner;
+	UT_StringHolder name;
+	int64 data_id;
+};
+
+struct OutputCopyCache
+{
+	UT_Array<fpreal64> topology_key;   // input topology and groups, output detail
+	UT_Array<InputAttribRecord> attribs;
+	UT_StringArray written_attribs;    // attributes the last cook modified
+};
+
+// Timed stages of a cook, in the order they run.
+enum CookStage
+{
+	STAGE_COPY = 0,       // output from input 0
+	STAGE_CURVES,         // curve samples and frames
+	STAGE_PIECES,         // points to curves
+	STAGE_BOUNDS,         // bounding box of every piece
+	STAGE_PROJECTION,     // projection on the object axis
+	STAGE_DEFORM,
+	STAGE_MOTION_BLUR,
+	STAGE_NORMALS,
+	NUM_STAGES
+};
+
+// Wall time of the stages of the last cook, with the time outside of them
+// as the remainder of the total.
+struct CookTimings
+{
+	double stage_seconds[NUM_STAGES];
+	double total_seconds;
+	exint num_points;
+	int num_threads;              // workers that ran the deform pass
+	fpreal time;
+
+	void clear();
+	double pointsPerSecond() const;
+	void formatJSON(const char *node_path, UT_WorkBuffer &buf) const;
+	void formatInfo(UT_WorkBuffer &buf) const;
+};
+
+// Adds the wall time of its scope to one stage.
+class ScopedStageTimer
+{
+public:
+	ScopedStageTimer(CookTimings &timings, CookStage stage)
+		: timings(timings), stage(stage), start(std::chrono::steady_clock::now())
+	{
+	}
+	~ScopedStageTimer()
+	{
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		timings.stage_seconds[stage] += elapsed.count();
+	}
+
+private:
+	CookTimings &timings;
+	CookStage stage;
+	std::chrono::steady_clock::time_point start;
+};
+
+// Adaptive samples of a NURBS or Bezier curve, baked when the curves change.
+struct SplineSamples
+{
+	std::vector<float> P;  // xyz triplets
+	std::vector<float> T;  // unit derivatives
+	std::vector<float> u;  // unit domain parameter
+};
+
+// Frame settings shared by all curves, evaluated once per cook.
+struct CurveFrameParms
+{
+	int frame_mode;       // pathdeform::FrameMode
+	bool use_up_vector;
+	UT_Vector3 up_vector;
+	bool use_twist;
+};
+
+// Parameters of one cook. Loaded from the node once, so the verb never
+// reads the node and can cook in compiled blocks. Offset, stretch and roll
+// are also evaluated at every shutter sample.
+class SOP_PathDeformParms : public SOP_NodeParms
+{
+public:
+	SOP_PathDeformParms();
+
+	virtual void loadFromOpSubclass(const LoadParms &loadparms);
+	virtual void copyFrom(const SOP_NodeParms *src);
+
+	exint axis;
+	exint multi_curve;
+	exint deform_mode;
+	UT_StringHolder piece_attrib;
+	exint frame_mode;
+	exint use_up_vector;
+	UT_Vector3D up_vector;
+	exint interpolation;
+	fpreal64 curve_tolerance;
+	exint use_curve_twist;
+	exint use_curve_width;
+	exint recompute_n;
+	exint normal_mode;
+	exint add_basis_attribs;
+	exint deform_vattribs;
+	UT_StringHolder vattribs;
+	exint stretch_to_len;
+	fpreal64 stretch;
+	fpreal64 offset;
+	fpreal64 roll;
+	exint motion_blur;
+	exint shutter_samples;
+	fpreal64 shutter;
+	exint add_velocity;
+	exint add_sample_p;
+	exint kernel;
+	exint add_timings;
+	exint copy_changed;
+	fpreal64 cook_time;
+
+	fpreal64 shutter_time;           // seconds
+	UT_Array<fpreal64> sample_offset; // per shutter sample, motion blur only
+	UT_Array<fpreal64> sample_stretch;
+	UT_Array<fpreal64> sample_roll;
+};
+
+// Scratch of one node or compiled instance, reused across cooks and
+// rebuilt only when its key changes.
+class SOP_PathDeformCache : public SOP_NodeCache
+{
+public:
+	SOP_PathDeformCache() { timings.clear(); }
+	virtual ~SOP_PathDeformCache() {}
+
+	pathdeform::CurveCache curve_cache;
+	PointProjectionCache point_cache;
+	PointAdjacencyCache adjacency_cache;
+	PointOverrideAttribs point_overrides;
+	OutputCopyCache copy_cache;
+	CookTimings timings;         // of the last successful cook
+	UT_Array<fpreal64> curve_cache_key;
+	UT_Array<fpreal64> piece_cache_key;
+	UT_Array<fpreal64> bounds_cache_key;
+	UT_Array<fpreal64> projection_cache_key;
+	UT_Array<fpreal64> adjacency_cache_key;
+};
+
+class SOP_PathDeformVerb : public SOP_NodeVerb
+{
+public:
+	virtual SOP_NodeParms *allocParms() const { return new SOP_PathDeformParms(); }
+	virtual SOP_NodeCache *allocCache() const { return new SOP_PathDeformCache(); }
+	virtual UT_StringHolder name() const { return "path_deform"; }
+	virtual CookMode cookMode(const SOP_NodeParms *parms) const { return COOK_GENERIC; }
+	virtual void cook(const CookParms &cookparms) const;
+
+	static const SOP_NodeVerb::Register<SOP_PathDeformVerb> theVerb;
+
+private:
+	static void copyInput(bool copy_changed, const GU_Detail *input_gdp, GU_Detail *gdp,
+			OutputCopyCache &copy_cache);
+	static void packCurveSamples(const GEO_Face *curve_prim, exint curve,
+			const GA_ROHandleV3 &hndl_curve_p, const GA_ROHandleF &hndl_curve_twist,
+			const GA_ROHandleF &hndl_curve_width, pathdeform::CurveCache &curve_cache);
+	static void bakeSplineSamples(const GEO_Face *curve_prim, fpreal tolerance,
+			SplineSamples &samples);
+	static void packSplineSamples(const GEO_Face *curve_prim, exint curve,
+			const SplineSamples &samples, const GA_ROHandleF &hndl_curve_twist,
+			const GA_ROHandleF &hndl_curve_width, pathdeform::CurveCache &curve_cache);
+	static void computeCurveFrames(const GEO_Face *curve_prim, exint curve,
+			const CurveFrameParms &frame_parms, pathdeform::CurveCache &curve_cache);
+	static bool mapPiecesToCurves(const CookParms &cookparms, const GU_Detail *gdp,
+			const GU_Detail *curve_gdp, const UT_StringHolder &piece_name, exint num_curves,
+			UT_Array<int> &point_curve);
+	static void computePieceBounds(const GU_Detail *gdp, int multi_curve, exint num_curves,
+			PointProjectionCache &point_cache);
+	static void computePointProjection(const GU_Detail *gdp, int axis, int multi_curve,
+			exint num_curves, PointProjectionCache &point_cache);
+	static void findPointOverrides(const SOP_PathDeformParms &parms, const GU_Detail *gdp,
+			PointOverrideAttribs &overrides);
+	static void computeDeformParms(const SOP_PathDeformParms &parms, fpreal64 offset,
+			fpreal64 stretch, fpreal64 roll, const SOP_PathDeformCache &cache, exint num_curves,
+			UT_Array<pathdeform::DeformParms> &deform_parms);
+	static void deformShutterSamples(const SOP_PathDeformParms &parms, SOP_PathDeformCache &cache,
+			GU_Detail *gdp, exint num_curves, const UT_Array<pathdeform::CurveSamples> &curves,
+			pathdeform::KernelISA isa);
+	static void recomputeNormals(GU_Detail *gdp, GA_Attribute *attr_geo_n, const int *point_curve,
+			SOP_PathDeformCache &cache);
+	static void reportTimings(const CookParms &cookparms, GU_Detail *gdp,
+			const CookTimings &timings);
+	static void extractPackedTransforms(GU_Detail *gdp, GA_Attribute *rows[3]);
+	static void applyPackedTransforms(GU_Detail *gdp, GA_Attribute *rows[3]);
+	static void findReorientAttribs(const SOP_PathDeformParms &parms, GU_Detail *gdp,
+			const GA_Attribute *attr_direction, const GA_Attribute *attr_normal,
+			const GA_Attribute *attr_up, UT_Array<GA_Attribute *> &vector_attribs,
+			UT_Array<GA_Attribute *> &quat_attribs);
+};
+
 
 class PathDeform: public SOP_Node
 {
@@ -23,38 +291,20 @@ public:
 	static PRM_Template parmsTemplatesList[];
 	static const char myInputLabels[2];
 
+	virtual const SOP_NodeVerb *cookVerb() const { return SOP_PathDeformVerb::theVerb.get(); }
+
 protected:
 	OP_ERROR cookMySop(OP_Context &context);
 	virtual bool updateParmsFlags();
-	void computeBboxAxis(const int &axis, UT_Vector3 &pt0, UT_Vector3 &pt1);
-	float pointRelativeToBbox(const UT_Vector3 &pt, const int &axis);
+	virtual void getNodeSpecificInfoText(OP_Context &context, OP_NodeInfoParms &iparms);
 
 private:
-	GA_RWHandleV3 hndl_curve_tang;
-	GA_RWHandleV3 hndl_curve_btang;
-	GA_RWHandleV3 hndl_curve_up;
-	GA_ROHandleV3 hndl_curve_p;
-	GA_ROHandleF hndl_curve_twist;
-	GA_ROHandleF hndl_curve_width;
-	void computeCurveAttributes(const GEO_Curve *curve_prim, fpreal time);
 	int PARM_USEUPVECTOR() {return evalInt("use_up_vector", 0, 0);}
-	int PARM_USETWIST() {return evalInt("use_curve_twist", 0, 0);}
-	int PARM_USEWIDTH() {return evalInt("use_curve_width", 0, 0);}
 	int PARM_STRETCH_TOLEN() {return evalInt("stretch_to_len", 0, 0);}
-	int PARM_AXIS() {return evalInt(PRMaxisName.getToken(), 0, 0); }
-	fpreal PARM_UPX(fpreal t) { return evalFloat("upvector", 0, t); }
-	fpreal PARM_UPY(fpreal t) { return evalFloat("upvector", 1, t); }
-	fpreal PARM_UPZ(fpreal t) { return evalFloat("upvector", 2, t); }
-	float PARM_OFFSET(fpreal t) {return evalFloat("offset",  0, t); }
-	float PARM_ROLL(fpreal t) {return evalFloat("roll",  0, t); }
-	float PARM_STRETCH(fpreal t) {return evalFloat("stretch",  0, t); }
-    void PARM_REORIENT_ATTRIBS(UT_String &str) {evalString(str, "vattribs", 0, 0);}
     int PARM_DEFORM_VECTORS() {return evalInt("deform_vattribs", 0, 0);}
-    int PARM_ADD_BASIS_ATTR() {return evalInt("add_basis_attribs", 0, 0);}
-
     int PARM_COMPUTE_N() {return evalInt("recompute_n", 0, 0);}
-
-    UT_Vector3 bbox_min, bbox_max;
+    int PARM_MULTI_CURVE() {return evalInt("multi_curve", 0, 0);}
+    int PARM_MOTION_BLUR() {return evalInt("motion_blur", 0, 0);}
 
 };
 
@@ -62,87 +312,65 @@ private:
 class ThreadedDeform {
 public:
 	ThreadedDeform(GA_Attribute *attr_geo_p,
-	GA_Attribute *attr_geo_n,
 	GA_Attribute *attr_direction,
 	GA_Attribute *attr_normal,
 	GA_Attribute *attr_up,
-	GA_RWHandleV3 &hndl_curve_tang,
-	GA_RWHandleV3 &hndl_curve_btang,
-	GA_RWHandleV3 &hndl_curve_up,
-	const GA_ROHandleV3 &hndl_curve_p,
-	const GA_ROHandleF &hndl_curve_twist,
-	const GA_ROHandleF &hndl_curve_width,
-	GA_AttributeRefMap &aref_map,
-	const GA_IndexMap &curveIndexMap,
-	const int &use_width,
-	const int &stretch_tolen,
-	const int &deform_vattribs,
+	const pathdeform::CurveSamples *curves,
+	const pathdeform::DeformParms *deform_parms,
+	const PointProjectionCache &projection,
+	const int *point_curve,
+	const pathdeform::KernelISA &isa,
+	const UT_Array<GA_Attribute *> &vector_attribs,
+	const UT_Array<GA_Attribute *> &quat_attribs,
+	const PointOverrideAttribs &overrides,
 	const int &axis,
-	const float &offset,
-	const float &step,
-	const unsigned int &curve_num_points,
-	const UT_BoundingBox &bbox,
-	const UT_Vector3 &axis_vector,
-	const UT_Vector3 &axis_pt0,
-	const UT_Vector3 &axis_pt1):
+	float *sample_p = nullptr):
 
 	attr_geo_p(attr_geo_p),
-		attr_geo_n(attr_geo_n),
 		attr_direction(attr_direction),
 		attr_normal(attr_normal),
 		attr_up(attr_up),
-		hndl_curve_tang(hndl_curve_tang),
-		hndl_curve_btang(hndl_curve_btang),
-		hndl_curve_up(hndl_curve_up),
-		hndl_curve_p(hndl_curve_p),
-		hndl_curve_twist(hndl_curve_twist),
-		hndl_curve_width(hndl_curve_width),
-		curveIndexMap(curveIndexMap),
-		aref_map(aref_map),
-		use_width(use_width),
-		stretch_tolen(stretch_tolen),
-		deform_vattribs(deform_vattribs),
+		curves(curves),
+		deform_parms(deform_parms),
+		projection(projection),
+		point_curve(point_curve),
+		isa(isa),
+		vector_attribs(vector_attribs),
+		quat_attribs(quat_attribs),
+		overrides(overrides),
 		axis(axis),
-		offset(offset),
-		step(step),
-		curve_num_points(curve_num_points),
-		bbox(bbox),
-		axis_vector(axis_vector),
-		axis_pt0(axis_pt0),
-		axis_pt1(axis_pt1)
+		sample_p(sample_p)
 	{
 
 	}
 
 
 	void operator()(const GA_SplittableRange &sr) const;
+	void deformRun(GA_Offset start, int count, int curve,
+			pathdeform::DeformBlock &block,
+			GA_RWPageHandleV3 &hndl_geo_p,
+			GA_RWPageHandleV3 &hndl_direction,
+			GA_RWPageHandleV3 &hndl_normal,
+			GA_RWPageHandleV3 &hndl_up,
+			UT_Array<GA_RWPageHandleV3> &hndl_vectors,
+			UT_Array<GA_RWPageHandleV4> &hndl_quats,
+			GA_ROPageHandleF *hndl_overrides) const;
 
 	private:
 		GA_Attribute *attr_geo_p;
-		GA_Attribute *attr_geo_n;
 		GA_Attribute *attr_direction;
 		GA_Attribute *attr_normal;
 		GA_Attribute *attr_up;
-		GA_RWHandleV3 hndl_curve_tang;
-		GA_RWHandleV3 hndl_curve_btang;
-		GA_RWHandleV3 hndl_curve_up;
-		GA_ROHandleV3 hndl_curve_p;
-		GA_ROHandleF hndl_curve_twist;
-		GA_ROHandleF hndl_curve_width;
-		GA_AttributeRefMap aref_map;
-		const GA_IndexMap &curveIndexMap;
-		UT_BoundingBox bbox;
-
-		int use_width;
-		int stretch_tolen;
-		int deform_vattribs;
-		int axis;
-		float offset;
-		float step;
-		unsigned int curve_num_points;
+		const pathdeform::CurveSamples *curves;     // one per curve
+		const pathdeform::DeformParms *deform_parms; // one per curve
+		const PointProjectionCache &projection;
+		const int *point_curve;  // curve per point offset, null if all use curve 0
+		pathdeform::KernelISA isa;
+		const UT_Array<GA_Attribute *> &vector_attribs; // vectors and normals to reorient
+		const UT_Array<GA_Attribute *> &quat_attribs;   // orientations to reorient
+		const PointOverrideAttribs &overrides;
 
-		UT_Vector3 axis_vector;
-		UT_Vector3 axis_pt0;
-		UT_Vector3 axis_pt1;
+		int axis;
+		float *sample_p; // xyz per point offset, written instead of P if set
 };
 #endif /* SOP_PATHDEFORM_H_ */